@@ -0,0 +1,203 @@
+#include "allocation.h"
+#include <algorithm>
+#include <cassert>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+std::atomic<bool> allocationTracking{false};
+std::atomic<bool> allocationHugePages{false};
+
+namespace
+{
+    // allocation tracking and every allocationRequireScopes(true) not yet released
+    std::atomic<int> scopeUsers{0};
+
+    struct ScopeStats
+    {
+        size_t allocations = 0;
+        size_t frees = 0;
+        size_t bytesAllocated = 0;
+        size_t bytesFreed = 0;
+        long long peakResident = 0;
+    };
+
+    struct Accounting
+    {
+        std::mutex mutex;
+        std::map<std::string, ScopeStats> scopes;
+        long long resident = 0;
+        long long peakResident = 0;
+    };
+
+    // never destroyed, matrices with static storage duration may be freed after main returns
+    Accounting &accounting()
+    {
+        static Accounting *instance = new Accounting();
+        return *instance;
+    }
+
+    // "phase/layer 1" of this thread, scopeEnds holds the length of the path before every push
+    thread_local std::string scopePath;
+    thread_local std::vector<size_t> scopeEnds;
+
+    ScopeStats &currentScope(Accounting &state)
+    {
+        return state.scopes[scopePath.empty() ? std::string("(unscoped)") : scopePath];
+    }
+
+    double mebibytes(double bytes)
+    {
+        return bytes / (1024.0 * 1024.0);
+    }
+}
+
+void allocationSetTracking(bool enabled)
+{
+    if (allocationTracking.exchange(enabled, std::memory_order_relaxed) != enabled)
+    {
+        allocationRequireScopes(enabled);
+    }
+}
+
+void allocationSetHugePages(bool enabled)
+{
+    allocationHugePages.store(enabled, std::memory_order_relaxed);
+}
+
+void *allocationLarge(size_t bytes)
+{
+    void *p = ::operator new(bytes, std::align_val_t(allocationHugePageBytes));
+#ifdef MADV_HUGEPAGE
+    // before the first touch, so the page faults already map huge pages
+    if (allocationHugePages.load(std::memory_order_relaxed))
+    {
+        madvise(p, bytes, MADV_HUGEPAGE);
+    }
+#endif
+    return p;
+}
+
+void allocationLargeFree(void *p, size_t bytes)
+{
+    ::operator delete(p, bytes, std::align_val_t(allocationHugePageBytes));
+}
+
+void allocationRequireScopes(bool required)
+{
+    scopeUsers.fetch_add(required ? 1 : -1, std::memory_order_relaxed);
+}
+
+const std::string &allocationScopePath()
+{
+    return scopePath;
+}
+
+void allocationSetPhase(const char *phase)
+{
+    if (scopeUsers.load(std::memory_order_relaxed) == 0)
+        return;
+
+    assert(scopeEnds.empty());
+    scopePath = phase;
+}
+
+void allocationRecord(size_t bytes)
+{
+    Accounting &state = accounting();
+    std::lock_guard<std::mutex> lock(state.mutex);
+
+    state.resident += static_cast<long long>(bytes);
+    state.peakResident = std::max(state.peakResident, state.resident);
+
+    ScopeStats &scope = currentScope(state);
+    scope.allocations++;
+    scope.bytesAllocated += bytes;
+    scope.peakResident = std::max(scope.peakResident, state.resident);
+}
+
+void allocationRelease(size_t bytes)
+{
+    Accounting &state = accounting();
+    std::lock_guard<std::mutex> lock(state.mutex);
+
+    // memory allocated before tracking was enabled is not part of resident
+    state.resident = std::max(0LL, state.resident - static_cast<long long>(bytes));
+
+    ScopeStats &scope = currentScope(state);
+    scope.frees++;
+    scope.bytesFreed += bytes;
+}
+
+void allocationReset()
+{
+    Accounting &state = accounting();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    state.scopes.clear();
+    state.peakResident = state.resident;
+}
+
+void allocationReport(std::ostream &out)
+{
+    Accounting &state = accounting();
+    std::lock_guard<std::mutex> lock(state.mutex);
+
+    size_t width = 12;
+    for (auto &entry : state.scopes)
+    {
+        width = std::max(width, entry.first.size() + 2);
+    }
+
+    std::ios::fmtflags flags = out.flags();
+    std::streamsize precision = out.precision();
+
+    out << "matrix memory by scope:" << std::endl;
+    out << std::left << std::setw(width) << "scope" << std::right << std::setw(12) << "allocs" << std::setw(12) << "frees"
+        << std::setw(14) << "MiB alloc" << std::setw(14) << "MiB freed" << std::setw(14) << "peak MiB" << std::endl;
+    out << std::fixed << std::setprecision(2);
+
+    for (auto &entry : state.scopes)
+    {
+        const ScopeStats &scope = entry.second;
+        out << std::left << std::setw(width) << entry.first << std::right << std::setw(12) << scope.allocations << std::setw(12) << scope.frees
+            << std::setw(14) << mebibytes(scope.bytesAllocated) << std::setw(14) << mebibytes(scope.bytesFreed)
+            << std::setw(14) << mebibytes(scope.peakResident) << std::endl;
+    }
+    out << "resident: " << mebibytes(state.resident) << " MiB, peak: " << mebibytes(state.peakResident) << " MiB" << std::endl;
+
+    out.flags(flags);
+    out.precision(precision);
+}
+
+AllocationScope::AllocationScope(const char *name, int index) : active(scopeUsers.load(std::memory_order_relaxed) > 0)
+{
+    if (!active)
+        return;
+
+    scopeEnds.push_back(scopePath.size());
+    if (!scopePath.empty())
+    {
+        scopePath += "/";
+    }
+    scopePath += name;
+    if (index >= 0)
+    {
+        scopePath += " " + std::to_string(index);
+    }
+}
+
+AllocationScope::~AllocationScope()
+{
+    if (!active)
+        return;
+
+    scopePath.resize(scopeEnds.back());
+    scopeEnds.pop_back();
+}
@@ -0,0 +1,112 @@
+#ifndef ALLOCATION_H
+#define ALLOCATION_H
+
+#include <atomic>
+#include <cstddef>
+#include <limits>
+#include <memory>
+#include <new>
+#include <ostream>
+#include <string>
+
+/*
+    opt-in accounting of matrix and dataset memory
+
+    the storage of Matrix, SparseMatrix, PackedMatrix and ByteDataset goes through TrackedAllocator.
+    while tracking is enabled every allocation and free is counted and attributed to the phase and
+    the nested AllocationScopes of the allocating thread (e.g. "train step/layer 1"), together with the peak of
+    the resident tracked memory seen inside the scope. disabled, the allocator costs one relaxed load.
+    the scope names are also kept while other per-scope accounting (counters.h) requires them.
+
+    allocations of at least allocationHugePageBytes are aligned to a 2 MiB boundary. with huge pages
+    enabled they are also advised to be backed by transparent huge pages (madvise), which saves most
+    TLB misses when streaming through matrices of several GiB. the kernel has to allow it
+    (/sys/kernel/mm/transparent_hugepage/enabled set to madvise or always), otherwise it is a no-op.
+*/
+
+extern std::atomic<bool> allocationTracking;
+extern std::atomic<bool> allocationHugePages;
+
+const size_t allocationHugePageBytes = 2 * 1024 * 1024;
+
+void allocationSetTracking(bool enabled);
+void allocationSetHugePages(bool enabled); // affects allocations made afterwards
+void *allocationLarge(size_t bytes);       // storage of TrackedAllocator from allocationHugePageBytes on
+void allocationLargeFree(void *p, size_t bytes);
+void allocationRequireScopes(bool required); // keeps the scope names up to date without tracking
+const std::string &allocationScopePath();   // "phase/layer 1" of this thread
+void allocationSetPhase(const char *phase); // root scope of this thread, outside of any AllocationScope
+void allocationRecord(size_t bytes);
+void allocationRelease(size_t bytes);
+void allocationReset();
+void allocationReport(std::ostream &out);
+
+// names the current phase or layer of this thread until it goes out of scope, index is appended if >= 0
+class AllocationScope
+{
+public:
+    explicit AllocationScope(const char *name, int index = -1);
+    ~AllocationScope();
+
+    AllocationScope(const AllocationScope &) = delete;
+    AllocationScope &operator=(const AllocationScope &) = delete;
+
+private:
+    bool active;
+};
+
+template <typename T>
+struct TrackedAllocator
+{
+    typedef T value_type;
+
+    TrackedAllocator() = default;
+    template <typename U>
+    TrackedAllocator(const TrackedAllocator<U> &) {}
+
+    T *allocate(size_t n)
+    {
+        if (n > std::numeric_limits<size_t>::max() / sizeof(T))
+        {
+            throw std::bad_array_new_length();
+        }
+        if (allocationTracking.load(std::memory_order_relaxed))
+        {
+            allocationRecord(n * sizeof(T));
+        }
+        // large or not depends on the size only, so deallocate takes the same path
+        if (n * sizeof(T) >= allocationHugePageBytes)
+        {
+            return static_cast<T *>(allocationLarge(n * sizeof(T)));
+        }
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T *p, size_t n)
+    {
+        if (allocationTracking.load(std::memory_order_relaxed))
+        {
+            allocationRelease(n * sizeof(T));
+        }
+        if (n * sizeof(T) >= allocationHugePageBytes)
+        {
+            allocationLargeFree(p, n * sizeof(T));
+            return;
+        }
+        std::allocator<T>().deallocate(p, n);
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const TrackedAllocator<T> &, const TrackedAllocator<U> &)
+{
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const TrackedAllocator<T> &, const TrackedAllocator<U> &)
+{
+    return false;
+}
+
+#endif
@@ -0,0 +1,212 @@
+#include "autotune.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+GemmAutotuner::GemmAutotuner(const char *cacheFile_) : cacheFile(cacheFile_), cpu(cpuModel())
+{
+    load();
+}
+
+std::string GemmAutotuner::cpuModel()
+{
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    std::string model = "unknown";
+
+    while (std::getline(cpuinfo, line))
+    {
+        if (line.compare(0, 10, "model name") == 0)
+        {
+            size_t colon = line.find(':');
+            if (colon != std::string::npos)
+            {
+                model = line.substr(colon + 1);
+            }
+            break;
+        }
+    }
+
+    // the model name is the first field of a cache line, keep it free of whitespace
+    model.erase(0, model.find_first_not_of(" \t"));
+    std::replace(model.begin(), model.end(), ' ', '_');
+    std::replace(model.begin(), model.end(), '\t', '_');
+    model += "_x" + std::to_string(std::max(1u, std::thread::hardware_concurrency()));
+    return model;
+}
+
+void GemmAutotuner::load()
+{
+    std::ifstream file(cacheFile);
+    std::string line;
+
+    while (std::getline(file, line))
+    {
+        std::stringstream ss(line);
+        std::string model, order;
+        uint rows, depth, cols;
+        GemmConfig config;
+
+        if (!(ss >> model >> rows >> depth >> cols >> order >> config.tileRows >> config.tileCols >> config.tileDepth >> config.threads))
+            continue;
+        if (config.tileRows == 0 || config.tileCols == 0 || config.tileDepth == 0 || config.threads == 0)
+            continue;
+
+        // caches written before the strassen field keep the classical kernel
+        if (!(ss >> config.strassenCutoff))
+            config.strassenCutoff = 0;
+
+        config.loopOrder = order == "ijk" ? GemmLoopOrder::IJK : GemmLoopOrder::IKJ;
+        cache[std::make_tuple(model, rows, depth, cols)] = config;
+
+        if (model == cpu)
+        {
+            matrixSetGemmConfig(rows, depth, cols, config);
+        }
+    }
+}
+
+void GemmAutotuner::save()
+{
+    if (!dirty)
+        return;
+
+    std::string temp = cacheFile + ".tmp";
+    std::ofstream file(temp);
+    if (!file.is_open())
+    {
+        std::cerr << "Error: Could not write tuning cache " << cacheFile << std::endl;
+        return;
+    }
+
+    for (auto &entry : cache)
+    {
+        const GemmConfig &config = entry.second;
+        file << std::get<0>(entry.first) << " " << std::get<1>(entry.first) << " " << std::get<2>(entry.first) << " " << std::get<3>(entry.first) << " "
+             << (config.loopOrder == GemmLoopOrder::IJK ? "ijk" : "ikj") << " "
+             << config.tileRows << " " << config.tileCols << " " << config.tileDepth << " " << config.threads << " " << config.strassenCutoff << "\n";
+    }
+    file.close();
+
+    if (std::rename(temp.c_str(), cacheFile.c_str()) == 0)
+    {
+        dirty = false;
+    }
+}
+
+double GemmAutotuner::benchmark(Matrix *in1, Matrix *in2, Matrix *out, const GemmConfig &config)
+{
+    // best of several runs, at least ~5 ms of work in total
+    matrixMultiplyConfig(in1, in2, out, config);
+
+    double best = 1e30;
+    double total = 0.0;
+    for (int run = 0; run < 3 || (total < 5e-3 && run < 1000); run++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        matrixMultiplyConfig(in1, in2, out, config);
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        best = std::min(best, elapsed);
+        total += elapsed;
+    }
+    return best;
+}
+
+void GemmAutotuner::tune(uint rows, uint depth, uint cols)
+{
+    GemmConfig config;
+    if (matrixGetGemmConfig(rows, depth, cols, &config))
+        return;
+
+    Matrix in1(rows, depth, 0.5f);
+    Matrix in2(depth, cols, 0.25f);
+    Matrix out(rows, cols);
+
+    std::vector<uint> threadCounts = {1};
+    uint hardwareThreads = std::thread::hardware_concurrency();
+    for (uint t = 2; t <= hardwareThreads; t *= 2)
+    {
+        threadCounts.push_back(t);
+    }
+    if (hardwareThreads > 1 && threadCounts.back() != hardwareThreads)
+    {
+        threadCounts.push_back(hardwareThreads);
+    }
+
+    GemmConfig best = matrixDefaultGemmConfig(rows, depth, cols);
+    double bestTime = benchmark(&in1, &in2, &out, best);
+
+    for (GemmLoopOrder order : {GemmLoopOrder::IKJ, GemmLoopOrder::IJK})
+    {
+        for (uint tileRows : {8u, 32u, 128u})
+        {
+            for (uint tileCols : {64u, 256u, 1024u})
+            {
+                for (uint tileDepth : {64u, 256u, 1024u})
+                {
+                    for (uint threads : threadCounts)
+                    {
+                        // skip tiles that only repeat a smaller candidate for this shape
+                        if ((tileRows > 8u && tileRows / 4 >= rows) || (tileCols > 64u && tileCols / 4 >= cols) || (tileDepth > 64u && tileDepth / 4 >= depth))
+                            continue;
+                        if (threads > rows)
+                            continue;
+
+                        GemmConfig candidate;
+                        candidate.loopOrder = order;
+                        candidate.tileRows = tileRows;
+                        candidate.tileCols = tileCols;
+                        candidate.tileDepth = tileDepth;
+                        candidate.threads = threads;
+
+                        double time = benchmark(&in1, &in2, &out, candidate);
+                        if (time < bestTime)
+                        {
+                            bestTime = time;
+                            best = candidate;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // Strassen-Winograd on top of the best blocking, kept only if faster and accurate enough
+    const float strassenMaxError = 1e-4f;
+    GemmConfig classical = best;
+    double classicalTime = bestTime;
+    float strassenError = 0.0f;
+    for (uint cutoff : {256u, 512u, 1024u})
+    {
+        if (std::min({rows, depth, cols}) < 2 * cutoff)
+            continue;
+
+        GemmConfig candidate = classical;
+        candidate.strassenCutoff = cutoff;
+        double time = benchmark(&in1, &in2, &out, candidate);
+        if (time >= bestTime)
+            continue;
+
+        float error = matrixStrassenError(rows, depth, cols, candidate);
+        if (error < strassenMaxError)
+        {
+            bestTime = time;
+            best = candidate;
+            strassenError = error;
+        }
+    }
+    if (best.strassenCutoff > 0)
+    {
+        std::cout << "gemm " << rows << "x" << depth << "x" << cols << ": strassen-winograd down to " << best.strassenCutoff << ", "
+                  << classicalTime / bestTime << "x faster, relative error " << strassenError << std::endl;
+    }
+
+    matrixSetGemmConfig(rows, depth, cols, best);
+    cache[std::make_tuple(cpu, rows, depth, cols)] = best;
+    dirty = true;
+}
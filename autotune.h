@@ -0,0 +1,37 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include "matrix.h"
+
+#include <map>
+#include <string>
+#include <tuple>
+
+/*
+    benchmarks GemmConfig candidates (loop order, tile sizes, threads, then Strassen-Winograd cutoffs
+    for large shapes) for a matrix product shape and registers the fastest one with matrixSetGemmConfig. results are persisted in a text file
+    keyed by cpu model and shape, so later runs on the same kind of machine skip the benchmark.
+
+    cache file line: <cpu model> <rows> <depth> <cols> <ijk|ikj> <tileRows> <tileCols> <tileDepth> <threads> <strassenCutoff>
+*/
+class GemmAutotuner
+{
+public:
+    GemmAutotuner(const char *cacheFile_);
+
+    void tune(uint rows, uint depth, uint cols);
+    void save();
+
+    static std::string cpuModel();
+
+private:
+    std::string cacheFile;
+    std::string cpu;
+    std::map<std::tuple<std::string, uint, uint, uint>, GemmConfig> cache;
+    bool dirty = false;
+
+    void load();
+    double benchmark(Matrix *in1, Matrix *in2, Matrix *out, const GemmConfig &config);
+};
+
+#endif
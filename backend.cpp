@@ -0,0 +1,480 @@
+#include "backend.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+
+#ifdef ML_HAVE_CBLAS
+#include <cblas.h>
+#endif
+
+/*
+    reference backend: one obvious loop per operation, sums in double
+*/
+namespace
+{
+    void referenceMultiply(Matrix *in1, Matrix *in2, Matrix *out)
+    {
+        for (uint i = 0; i < out->rows; i++)
+        {
+            for (uint j = 0; j < out->cols; j++)
+            {
+                double sum = 0.0;
+                for (uint k = 0; k < in1->cols; k++)
+                {
+                    sum += static_cast<double>(in1->data[static_cast<size_t>(i) * in1->cols + k]) * in2->data[static_cast<size_t>(k) * in2->cols + j];
+                }
+                out->data[static_cast<size_t>(i) * out->cols + j] = static_cast<float>(sum);
+            }
+        }
+    }
+
+    void referenceAdd(Matrix *in1, Matrix *in2, Matrix *out)
+    {
+        for (size_t i = 0; i < out->data.size(); i++)
+            out->data[i] = in1->data[i] + in2->data[i];
+    }
+
+    void referenceSubstract(Matrix *in1, Matrix *in2, Matrix *out)
+    {
+        for (size_t i = 0; i < out->data.size(); i++)
+            out->data[i] = in1->data[i] - in2->data[i];
+    }
+
+    void referenceHadamard(Matrix *in1, Matrix *in2, Matrix *out)
+    {
+        for (size_t i = 0; i < out->data.size(); i++)
+            out->data[i] = in1->data[i] * in2->data[i];
+    }
+
+    void referenceScalarMultiply(Matrix *in, float scalar, Matrix *out)
+    {
+        for (size_t i = 0; i < out->data.size(); i++)
+            out->data[i] = in->data[i] * scalar;
+    }
+
+    void referenceVectorAdd(Matrix *in, Matrix *vec, Matrix *out)
+    {
+        for (uint i = 0; i < out->rows; i++)
+        {
+            for (uint j = 0; j < out->cols; j++)
+                out->data[static_cast<size_t>(i) * out->cols + j] = in->data[static_cast<size_t>(i) * in->cols + j] + vec->data[i];
+        }
+    }
+
+    void referenceSum(Matrix *in, float *out)
+    {
+        double sum = 0.0;
+        for (float value : in->data)
+            sum += value;
+        *out = static_cast<float>(sum);
+    }
+
+    void referenceRowMean(Matrix *in, Matrix *out)
+    {
+        for (uint i = 0; i < in->rows; i++)
+        {
+            double sum = 0.0;
+            for (uint j = 0; j < in->cols; j++)
+                sum += in->data[static_cast<size_t>(i) * in->cols + j];
+            out->data[i] = static_cast<float>(sum / in->cols);
+        }
+    }
+
+    void referenceSigmoid(Matrix *in, Matrix *out)
+    {
+        for (size_t i = 0; i < out->data.size(); i++)
+            out->data[i] = static_cast<float>(1.0 / (1.0 + std::exp(-static_cast<double>(in->data[i]))));
+    }
+
+    void referenceReLu(Matrix *in, Matrix *out)
+    {
+        for (size_t i = 0; i < out->data.size(); i++)
+            out->data[i] = std::max(in->data[i], 0.0f);
+    }
+
+    void referenceSoftMax(Matrix *in, Matrix *out)
+    {
+        uint rows = in->rows;
+        uint cols = in->cols;
+        for (uint j = 0; j < cols; j++)
+        {
+            double max = in->data[j];
+            for (uint i = 1; i < rows; i++)
+                max = std::max(max, static_cast<double>(in->data[static_cast<size_t>(i) * cols + j]));
+
+            double sum = 0.0;
+            for (uint i = 0; i < rows; i++)
+                sum += std::exp(in->data[static_cast<size_t>(i) * cols + j] - max);
+
+            for (uint i = 0; i < rows; i++)
+                out->data[static_cast<size_t>(i) * cols + j] = static_cast<float>(std::exp(in->data[static_cast<size_t>(i) * cols + j] - max) / sum);
+        }
+    }
+
+    void referenceSoftMaxCrossEntropy(Matrix *logits, Matrix *labels, Matrix *gradient, Matrix *gradbias, float *loss)
+    {
+        uint cols = logits->cols;
+        referenceSoftMax(logits, gradient);
+
+        double lossSum = 0.0;
+        for (uint j = 0; j < cols; j++)
+        {
+            uint label = static_cast<uint>(labels->data[j]);
+            assert(label < logits->rows);
+            lossSum -= std::log(static_cast<double>(gradient->data[static_cast<size_t>(label) * cols + j]));
+            gradient->data[static_cast<size_t>(label) * cols + j] -= 1.0f;
+        }
+        referenceRowMean(gradient, gradbias);
+        *loss = static_cast<float>(lossSum / cols);
+    }
+
+    void referenceSigmoidLogLoss(Matrix *logits, Matrix *labels, Matrix *gradient, Matrix *gradbias, float *loss)
+    {
+        uint rows = logits->rows;
+        uint cols = logits->cols;
+        double lossSum = 0.0;
+        for (uint i = 0; i < rows; i++)
+        {
+            for (uint j = 0; j < cols; j++)
+            {
+                double z = logits->data[static_cast<size_t>(i) * cols + j];
+                double y = static_cast<uint>(labels->data[j]) == i ? 1.0 : 0.0;
+                double p = 1.0 / (1.0 + std::exp(-z));
+                lossSum -= y * std::log(p) + (1.0 - y) * std::log(1.0 - p);
+                gradient->data[static_cast<size_t>(i) * cols + j] = static_cast<float>(p - y);
+            }
+        }
+        referenceRowMean(gradient, gradbias);
+        *loss = static_cast<float>(lossSum / cols);
+    }
+
+    void referenceReLuMSE(Matrix *logits, Matrix *labels, Matrix *gradient, Matrix *gradbias, float *loss)
+    {
+        uint rows = logits->rows;
+        uint cols = logits->cols;
+        double lossSum = 0.0;
+        for (uint i = 0; i < rows; i++)
+        {
+            for (uint j = 0; j < cols; j++)
+            {
+                double z = logits->data[static_cast<size_t>(i) * cols + j];
+                double y = static_cast<uint>(labels->data[j]) == i ? 1.0 : 0.0;
+                double difference = std::max(z, 0.0) - y;
+                lossSum += difference * difference;
+                gradient->data[static_cast<size_t>(i) * cols + j] = z >= 0.0 ? static_cast<float>(2.0 * difference) : 0.0f;
+            }
+        }
+        referenceRowMean(gradient, gradbias);
+        *loss = static_cast<float>(lossSum / cols);
+    }
+
+    void referenceCategoricalCrossEntropy(Matrix *in, Matrix *groundtruth, float *loss)
+    {
+        double sum = 0.0;
+        for (size_t i = 0; i < in->data.size(); i++)
+            sum -= groundtruth->data[i] * std::log(static_cast<double>(in->data[i]));
+        *loss = static_cast<float>(sum / in->cols);
+    }
+
+    void referenceMSE(Matrix *in, Matrix *groundtruth, float *loss)
+    {
+        double sum = 0.0;
+        for (size_t i = 0; i < in->data.size(); i++)
+        {
+            double difference = static_cast<double>(groundtruth->data[i]) - in->data[i];
+            sum += difference * difference;
+        }
+        *loss = static_cast<float>(sum / in->cols);
+    }
+
+    void referenceLogLoss(Matrix *in, Matrix *groundtruth, float *loss)
+    {
+        double sum = 0.0;
+        for (size_t i = 0; i < in->data.size(); i++)
+        {
+            double y = groundtruth->data[i];
+            double p = in->data[i];
+            sum -= y * std::log(p) + (1.0 - y) * std::log(1.0 - p);
+        }
+        *loss = static_cast<float>(sum / in->cols);
+    }
+
+#ifdef ML_HAVE_CBLAS
+    void blasMultiply(Matrix *in1, Matrix *in2, Matrix *out)
+    {
+        cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, out->rows, out->cols, in1->cols,
+                    1.0f, in1->data.data(), in1->cols, in2->data.data(), in2->cols, 0.0f, out->data.data(), out->cols);
+    }
+#endif
+
+    const Backend *initialBackend()
+    {
+        const char *requested = std::getenv("ML_BACKEND");
+        if (requested != nullptr)
+        {
+            for (const Backend *backend : backendList())
+            {
+                if (requested == std::string(backend->name))
+                    return backend;
+            }
+            std::cerr << "Warning: unknown or unavailable ML_BACKEND=" << requested << ", using native" << std::endl;
+        }
+        return &backendNative();
+    }
+
+    const Backend *&activeBackend()
+    {
+        static const Backend *backend = initialBackend();
+        return backend;
+    }
+}
+
+const Backend &backendReference()
+{
+    static const Backend reference = {"reference",
+                                      referenceMultiply,
+                                      referenceAdd, referenceSubstract, referenceHadamard, referenceScalarMultiply, referenceVectorAdd,
+                                      referenceSum, referenceRowMean,
+                                      referenceSigmoid, referenceReLu, referenceSoftMax,
+                                      referenceSoftMaxCrossEntropy, referenceSigmoidLogLoss, referenceReLuMSE,
+                                      referenceCategoricalCrossEntropy, referenceMSE, referenceLogLoss};
+    return reference;
+}
+
+const Backend *backendBlas()
+{
+#ifdef ML_HAVE_CBLAS
+    static const Backend blas = []
+    {
+        Backend backend = backendNative();
+        backend.name = "blas";
+        backend.multiply = blasMultiply;
+        return backend;
+    }();
+    return &blas;
+#else
+    return nullptr;
+#endif
+}
+
+std::vector<const Backend *> backendList()
+{
+    std::vector<const Backend *> backends = {&backendReference(), &backendNative()};
+    if (backendBlas() != nullptr)
+    {
+        backends.push_back(backendBlas());
+    }
+    return backends;
+}
+
+const Backend &backendActive()
+{
+    return *activeBackend();
+}
+
+bool backendSelect(const std::string &name)
+{
+    for (const Backend *backend : backendList())
+    {
+        if (name == backend->name)
+        {
+            activeBackend() = backend;
+            return true;
+        }
+    }
+    return false;
+}
+
+namespace
+{
+    void fillUniform(Matrix *m, std::mt19937 &rng, float low, float high)
+    {
+        std::uniform_real_distribution<float> distribution(low, high);
+        for (float &value : m->data)
+            value = distribution(rng);
+    }
+
+    // max |difference| relative to the largest reference value (at least 1)
+    float relativeError(const Matrix &reference, const Matrix &result)
+    {
+        float scale = 1.0f;
+        float difference = 0.0f;
+        for (size_t i = 0; i < reference.data.size(); i++)
+        {
+            scale = std::max(scale, std::abs(reference.data[i]));
+            difference = std::max(difference, std::abs(reference.data[i] - result.data[i]));
+        }
+        return difference / scale;
+    }
+
+    float relativeError(float reference, float result)
+    {
+        return std::abs(reference - result) / std::max(1.0f, std::abs(reference));
+    }
+}
+
+bool backendConformance(std::ostream &out)
+{
+    const Backend &reference = backendReference();
+
+    // rows x depth x cols: vector widths, their remainders, the blocking of the gemm and two levels of
+    // Strassen-Winograd recursion at strassenCutoff, odd dimensions included
+    const std::vector<std::vector<uint>> shapes = {{1, 1, 1}, {3, 5, 7}, {17, 33, 9}, {10, 64, 100}, {64, 784, 65}, {130, 257, 31}, {97, 160, 75}};
+    const uint strassenCutoff = 16;
+    const uint gemmThreads = 4;
+
+    // gemm and sums add up to 784 floats in a different order than the reference
+    const float sumTolerance = 1e-4f;
+    const float elementTolerance = 1e-5f;
+
+    bool conformant = true;
+    for (const Backend *backend : backendList())
+    {
+        if (backend == &reference)
+            continue;
+
+        std::vector<std::pair<std::string, float>> errors;
+        auto record = [&](const char *operation, float error)
+        {
+            auto it = std::find_if(errors.begin(), errors.end(), [&](const std::pair<std::string, float> &e)
+                                   { return e.first == operation; });
+            if (it == errors.end())
+                errors.push_back({operation, error});
+            else
+                it->second = std::max(it->second, error);
+        };
+
+        std::mt19937 rng(7);
+        for (const std::vector<uint> &shape : shapes)
+        {
+            uint rows = shape[0];
+            uint depth = shape[1];
+            uint cols = shape[2];
+
+            Matrix a(rows, depth), b(depth, cols), x(rows, cols), y(rows, cols), vec(rows, 1);
+            fillUniform(&a, rng, -1.0f, 1.0f);
+            fillUniform(&b, rng, -1.0f, 1.0f);
+            fillUniform(&x, rng, -8.0f, 8.0f);
+            fillUniform(&y, rng, -8.0f, 8.0f);
+            fillUniform(&vec, rng, -1.0f, 1.0f);
+
+            Matrix expected(rows, cols), result(rows, cols);
+            reference.multiply(&a, &b, &expected);
+            backend->multiply(&a, &b, &result);
+            record("multiply", relativeError(expected, result));
+
+            // the native gemm also runs split over threads and as Strassen-Winograd, whatever the tuned config of the shape
+            if (backend == &backendNative())
+            {
+                GemmConfig threaded = matrixDefaultGemmConfig(rows, depth, cols);
+                threaded.threads = gemmThreads;
+                threaded.strassenCutoff = 0;
+                matrixMultiplyConfig(&a, &b, &result, threaded);
+                record("multiplyThreaded", relativeError(expected, result));
+
+                GemmConfig strassen = threaded;
+                strassen.strassenCutoff = strassenCutoff;
+                matrixMultiplyStrassen(&a, &b, &result, strassen);
+                record("multiplyStrassen", relativeError(expected, result));
+            }
+
+            reference.add(&x, &y, &expected);
+            backend->add(&x, &y, &result);
+            record("add", relativeError(expected, result));
+
+            reference.substract(&x, &y, &expected);
+            backend->substract(&x, &y, &result);
+            record("substract", relativeError(expected, result));
+
+            reference.hadamard(&x, &y, &expected);
+            backend->hadamard(&x, &y, &result);
+            record("hadamard", relativeError(expected, result));
+
+            reference.scalarMultiply(&x, 0.37f, &expected);
+            backend->scalarMultiply(&x, 0.37f, &result);
+            record("scalarMultiply", relativeError(expected, result));
+
+            reference.vectorAdd(&x, &vec, &expected);
+            backend->vectorAdd(&x, &vec, &result);
+            record("vectorAdd", relativeError(expected, result));
+
+            float expectedSum, resultSum;
+            reference.sum(&x, &expectedSum);
+            backend->sum(&x, &resultSum);
+            record("sum", relativeError(expectedSum, resultSum));
+
+            Matrix expectedMean(rows, 1), resultMean(rows, 1);
+            reference.rowMean(&x, &expectedMean);
+            backend->rowMean(&x, &resultMean);
+            record("rowMean", relativeError(expectedMean, resultMean));
+
+            reference.sigmoid(&x, &expected);
+            backend->sigmoid(&x, &result);
+            record("sigmoid", relativeError(expected, result));
+
+            reference.relu(&x, &expected);
+            backend->relu(&x, &result);
+            record("relu", relativeError(expected, result));
+
+            reference.softMax(&x, &expected);
+            backend->softMax(&x, &result);
+            record("softMax", relativeError(expected, result));
+
+            // class indices, their one-hot encoding and probabilities for the losses
+            Matrix labels(1, cols), oneHot(rows, cols), binary(rows, cols), probabilities(rows, cols);
+            std::uniform_int_distribution<uint> classes(0, rows - 1);
+            for (uint j = 0; j < cols; j++)
+            {
+                labels.data[j] = static_cast<float>(classes(rng));
+                oneHot.data[static_cast<size_t>(labels.data[j]) * cols + j] = 1.0f;
+            }
+            for (float &value : binary.data)
+                value = static_cast<float>(rng() % 2);
+            fillUniform(&probabilities, rng, 0.01f, 0.99f);
+
+            float expectedLoss, resultLoss;
+            reference.softMaxCrossEntropy(&x, &labels, &expected, &expectedMean, &expectedLoss);
+            backend->softMaxCrossEntropy(&x, &labels, &result, &resultMean, &resultLoss);
+            record("softMaxCrossEntropy", std::max({relativeError(expected, result), relativeError(expectedMean, resultMean), relativeError(expectedLoss, resultLoss)}));
+
+            reference.sigmoidLogLoss(&x, &labels, &expected, &expectedMean, &expectedLoss);
+            backend->sigmoidLogLoss(&x, &labels, &result, &resultMean, &resultLoss);
+            record("sigmoidLogLoss", std::max({relativeError(expected, result), relativeError(expectedMean, resultMean), relativeError(expectedLoss, resultLoss)}));
+
+            reference.reluMSE(&x, &labels, &expected, &expectedMean, &expectedLoss);
+            backend->reluMSE(&x, &labels, &result, &resultMean, &resultLoss);
+            record("reluMSE", std::max({relativeError(expected, result), relativeError(expectedMean, resultMean), relativeError(expectedLoss, resultLoss)}));
+
+            Matrix softmax(rows, cols);
+            reference.softMax(&x, &softmax);
+            reference.categoricalCrossEntropy(&softmax, &oneHot, &expectedLoss);
+            backend->categoricalCrossEntropy(&softmax, &oneHot, &resultLoss);
+            record("categoricalCrossEntropy", relativeError(expectedLoss, resultLoss));
+
+            reference.mse(&x, &y, &expectedLoss);
+            backend->mse(&x, &y, &resultLoss);
+            record("mse", relativeError(expectedLoss, resultLoss));
+
+            reference.logLoss(&probabilities, &binary, &expectedLoss);
+            backend->logLoss(&probabilities, &binary, &resultLoss);
+            record("logLoss", relativeError(expectedLoss, resultLoss));
+        }
+
+        for (const std::pair<std::string, float> &error : errors)
+        {
+            bool summed = error.first.compare(0, 8, "multiply") == 0 || error.first == "sum" || error.first == "rowMean" || error.first == "mse" ||
+                          error.first == "categoricalCrossEntropy" || error.first == "logLoss" || error.first == "softMaxCrossEntropy" ||
+                          error.first == "sigmoidLogLoss" || error.first == "reluMSE";
+            float tolerance = summed ? sumTolerance : elementTolerance;
+            bool passed = error.second <= tolerance;
+            conformant = conformant && passed;
+            out << std::left << std::setw(10) << backend->name << std::setw(26) << error.first << std::right
+                << "max relative error " << std::setw(12) << error.second << (passed ? "  ok" : "  FAILED") << std::endl;
+        }
+    }
+    return conformant;
+}
@@ -0,0 +1,63 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include "matrix.h"
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+/*
+    compute backends behind the matrix functions
+
+    matrixMultiply, the elementwise operators, the reductions, the activations and the losses of
+    matrix.h check their arguments and hand the work to the active backend, so layers and models
+    never see which one runs:
+        reference  plain loops accumulating in double, the definition the others are checked against
+        native     the cpu-dispatched kernels of matrix.cpp (blocked gemm, simd elementwise)
+        blas       native with the gemm of an external cblas, when one was found at configure time
+    the fused backward, packed and sparse kernels always run native.
+    the initial backend is native or the environment variable ML_BACKEND=reference|native|blas.
+*/
+
+struct Backend
+{
+    const char *name;
+
+    void (*multiply)(Matrix *in1, Matrix *in2, Matrix *out);
+
+    void (*add)(Matrix *in1, Matrix *in2, Matrix *out);
+    void (*substract)(Matrix *in1, Matrix *in2, Matrix *out);
+    void (*hadamard)(Matrix *in1, Matrix *in2, Matrix *out);
+    void (*scalarMultiply)(Matrix *in, float scalar, Matrix *out);
+    void (*vectorAdd)(Matrix *in, Matrix *vec, Matrix *out);
+
+    void (*sum)(Matrix *in, float *out);
+    void (*rowMean)(Matrix *in, Matrix *out);
+
+    void (*sigmoid)(Matrix *in, Matrix *out);
+    void (*relu)(Matrix *in, Matrix *out);
+    void (*softMax)(Matrix *in, Matrix *out);
+
+    void (*softMaxCrossEntropy)(Matrix *logits, Matrix *labels, Matrix *gradient, Matrix *gradbias, float *loss);
+    void (*sigmoidLogLoss)(Matrix *logits, Matrix *labels, Matrix *gradient, Matrix *gradbias, float *loss);
+    void (*reluMSE)(Matrix *logits, Matrix *labels, Matrix *gradient, Matrix *gradbias, float *loss);
+    void (*categoricalCrossEntropy)(Matrix *in, Matrix *groundtruth, float *loss);
+    void (*mse)(Matrix *in, Matrix *groundtruth, float *loss);
+    void (*logLoss)(Matrix *in, Matrix *groundtruth, float *loss);
+};
+
+const Backend &backendReference();
+const Backend &backendNative();
+const Backend *backendBlas(); // nullptr if built without cblas
+
+std::vector<const Backend *> backendList();
+const Backend &backendActive();
+bool backendSelect(const std::string &name); // call before any kernel runs concurrently, false for an unknown backend
+
+// runs every operation of every backend on random data against the reference and prints the
+// largest relative difference per operation, false if any exceeds its tolerance. the native gemm is
+// also checked threaded and as Strassen-Winograd. registered with ctest (benchmark --conformance)
+bool backendConformance(std::ostream &out);
+
+#endif
@@ -0,0 +1,300 @@
+#include "matrix.h"
+#include "backend.h"
+#include "layer.h"
+#include "model.h"
+#include "graph.h"
+#include "hogwild.h"
+#include "sweep.h"
+#include "counters.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/*
+    end-to-end throughput of Model training steps and predict on synthetic data
+
+    usage: benchmark [--output results.json] [--baseline baseline.json] [--threshold 0.10] [--seconds 0.5] [--counters]
+                     [--backend reference|native|blas] [--conformance] [--graph-conformance] [--sweep-conformance]
+                     [--huge-pages]
+
+    every scenario reports samples per second (best of three runs of at least --seconds each) as json.
+    with --baseline the results are compared against a previous output, the exit code is 1 if any
+    scenario is more than threshold (fraction) slower than its baseline.
+    --counters prints hardware counters per kernel and topology (counters.h) to stderr.
+    --backend runs the scenarios on another compute backend (backend.h), --conformance only checks
+    every backend against the reference and exits with 1 on a mismatch.
+    --graph-conformance checks the DAG model of graph.h against Model and finite differences (graphConformance).
+    --sweep-conformance checks models trained through Sweep against the same models trained alone (sweepConformance).
+    --huge-pages backs large matrices with transparent huge pages (allocation.h).
+*/
+
+struct Topology
+{
+    std::string name;
+    std::vector<uint> sizes; // input, hidden..., classes
+    ActivationType hiddenActivation;
+};
+
+struct Result
+{
+    std::string name;
+    double samplesPerSecond;
+};
+
+Model *buildModel(const Topology &topology)
+{
+    Model *model = new Model(1);
+    for (size_t i = 1; i < topology.sizes.size(); i++)
+    {
+        bool output = i + 1 == topology.sizes.size();
+        model->addLayer(new Layer(topology.sizes[i - 1], topology.sizes[i], output ? ActivationType::SOFTMAX : topology.hiddenActivation));
+    }
+    return model;
+}
+
+void fillSynthetic(Matrix *data, Matrix *labels, uint classes, std::mt19937 &rng)
+{
+    std::uniform_real_distribution<float> pixel(0.0f, 1.0f);
+    for (float &value : data->data)
+    {
+        value = pixel(rng);
+    }
+    for (float &label : labels->data)
+    {
+        label = static_cast<float>(rng() % classes);
+    }
+}
+
+// samples per second of run(), which processes samplesPerRun samples
+template <typename F>
+double measure(double seconds, uint samplesPerRun, F run)
+{
+    run(); // warm-up, first-touch allocations
+
+    double best = 0.0;
+    for (int repeat = 0; repeat < 3; repeat++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        size_t samples = 0;
+        double elapsed = 0.0;
+        do
+        {
+            run();
+            samples += samplesPerRun;
+            elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        } while (elapsed < seconds);
+
+        best = std::max(best, samples / elapsed);
+    }
+    return best;
+}
+
+void benchmarkTopology(const Topology &topology, double seconds, std::vector<Result> *results)
+{
+    const uint trainBatch = 100;
+    const uint predictBatch = 1000;
+    uint inputs = topology.sizes.front();
+    uint classes = topology.sizes.back();
+    std::mt19937 rng(42);
+
+    Model *model = buildModel(topology);
+    model->initTraining(trainBatch);
+
+    Matrix batch(inputs, trainBatch);
+    Matrix labels(1, trainBatch);
+    fillSynthetic(&batch, &labels, classes, rng);
+
+    results->push_back({topology.name + "/train", measure(seconds, trainBatch, [&]
+                                                          {
+                                                              float loss;
+                                                              model->forwardBackward(&batch, &labels, &loss);
+                                                              model->step(0.01f); })});
+
+    // lock-free asynchronous sgd on one worker per hardware thread, a few batches per run
+    const uint hogwildBatches = 8;
+    Matrix hogwildData(inputs, trainBatch * hogwildBatches);
+    Matrix hogwildLabels(1, trainBatch * hogwildBatches);
+    fillSynthetic(&hogwildData, &hogwildLabels, classes, rng);
+    Hogwild hogwild(model, trainBatch);
+
+    results->push_back({topology.name + "/train_hogwild", measure(seconds, trainBatch * hogwildBatches, [&]
+                                                                  { hogwild.trainEpoch(&hogwildData, &hogwildLabels, 0.01f); })});
+
+    Matrix predictData(inputs, predictBatch);
+    Matrix predictLabels(1, predictBatch);
+    Matrix prediction(classes, predictBatch);
+    fillSynthetic(&predictData, &predictLabels, classes, rng);
+
+    results->push_back({topology.name + "/predict_batched", measure(seconds, predictBatch, [&]
+                                                                    { model->predict(&predictData, &prediction); })});
+
+    Matrix sample(inputs, 1);
+    Matrix samplePrediction(classes, 1);
+    predictData.getCols(0, 1, &sample);
+
+    results->push_back({topology.name + "/predict_single", measure(seconds, 1, [&]
+                                                                   { model->predict(&sample, &samplePrediction); })});
+
+    delete model;
+}
+
+std::string toJson(const std::vector<Result> &results)
+{
+    std::ostringstream json;
+    json << "{\n    \"isa\": \"" << matrixIsaName(matrixGetIsaLevel()) << "\",\n    \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        json << "        {\"name\": \"" << results[i].name << "\", \"samples_per_sec\": " << results[i].samplesPerSecond << "}"
+             << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    json << "    ]\n}\n";
+    return json.str();
+}
+
+// reads the (name, samples_per_sec) pairs of a file written by toJson
+bool loadBaseline(const char *filename, std::vector<Result> *baseline)
+{
+    std::ifstream file(filename);
+    if (!file.is_open())
+    {
+        std::cerr << "Error: Could not open baseline " << filename << std::endl;
+        return false;
+    }
+    std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    const std::string nameKey = "\"name\": \"";
+    const std::string rateKey = "\"samples_per_sec\": ";
+    size_t position = 0;
+    while ((position = text.find(nameKey, position)) != std::string::npos)
+    {
+        size_t nameBegin = position + nameKey.size();
+        size_t nameEnd = text.find('"', nameBegin);
+        size_t rate = text.find(rateKey, nameEnd);
+        if (nameEnd == std::string::npos || rate == std::string::npos)
+            break;
+
+        Result result;
+        result.name = text.substr(nameBegin, nameEnd - nameBegin);
+        result.samplesPerSecond = std::strtod(text.c_str() + rate + rateKey.size(), nullptr);
+        baseline->push_back(result);
+        position = rate;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    const char *output = nullptr;
+    const char *baselineFile = nullptr;
+    double threshold = 0.10;
+    double seconds = 0.5;
+    bool counters = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        bool hasValue = i + 1 < argc;
+        if (std::strcmp(argv[i], "--output") == 0 && hasValue)
+            output = argv[++i];
+        else if (std::strcmp(argv[i], "--baseline") == 0 && hasValue)
+            baselineFile = argv[++i];
+        else if (std::strcmp(argv[i], "--threshold") == 0 && hasValue)
+            threshold = std::atof(argv[++i]);
+        else if (std::strcmp(argv[i], "--seconds") == 0 && hasValue)
+            seconds = std::atof(argv[++i]);
+        else if (std::strcmp(argv[i], "--counters") == 0)
+            counters = true;
+        else if (std::strcmp(argv[i], "--backend") == 0 && hasValue)
+        {
+            if (!backendSelect(argv[++i]))
+            {
+                std::cerr << "Error: unknown or unavailable backend " << argv[i] << std::endl;
+                return 2;
+            }
+        }
+        else if (std::strcmp(argv[i], "--conformance") == 0)
+            return backendConformance(std::cout) ? 0 : 1;
+        else if (std::strcmp(argv[i], "--graph-conformance") == 0)
+            return graphConformance(std::cout) ? 0 : 1;
+        else if (std::strcmp(argv[i], "--sweep-conformance") == 0)
+            return sweepConformance(std::cout) ? 0 : 1;
+        else if (std::strcmp(argv[i], "--huge-pages") == 0)
+            allocationSetHugePages(true);
+        else
+        {
+            std::cerr << "usage: " << argv[0] << " [--output results.json] [--baseline baseline.json] [--threshold 0.10] [--seconds 0.5] [--counters] [--backend name] [--conformance] [--graph-conformance] [--sweep-conformance] [--huge-pages]" << std::endl;
+            return 2;
+        }
+    }
+
+    // the topology of main.cpp and a few larger mlps
+    std::vector<Topology> topologies = {
+        {"mnist_784-64-32-10", {784, 64, 32, 10}, ActivationType::SIGMOID},
+        {"wide_784-512-256-10", {784, 512, 256, 10}, ActivationType::RELU},
+        {"deep_1024-256x4-10", {1024, 256, 256, 256, 256, 10}, ActivationType::RELU},
+        {"large_2048-1024-1024-100", {2048, 1024, 1024, 100}, ActivationType::RELU},
+    };
+
+    if (counters && !countersSetEnabled(true))
+    {
+        std::cerr << "hardware counters unavailable, timing kernels only" << std::endl;
+    }
+
+    std::vector<Result> results;
+    for (const Topology &topology : topologies)
+    {
+        std::cerr << "running " << topology.name << " ..." << std::endl;
+        allocationSetPhase(topology.name.c_str());
+        benchmarkTopology(topology, seconds, &results);
+    }
+    if (counters)
+    {
+        countersReport(std::cerr);
+    }
+
+    std::string json = toJson(results);
+    std::cout << json;
+    if (output != nullptr)
+    {
+        std::ofstream file(output);
+        file << json;
+    }
+
+    if (baselineFile == nullptr)
+        return 0;
+
+    std::vector<Result> baseline;
+    if (!loadBaseline(baselineFile, &baseline))
+        return 2;
+
+    bool regressed = false;
+    for (const Result &result : results)
+    {
+        auto match = std::find_if(baseline.begin(), baseline.end(), [&](const Result &b)
+                                  { return b.name == result.name; });
+        if (match == baseline.end() || match->samplesPerSecond <= 0.0)
+        {
+            std::cerr << result.name << ": no baseline" << std::endl;
+            continue;
+        }
+
+        double change = result.samplesPerSecond / match->samplesPerSecond - 1.0;
+        bool slower = change < -threshold;
+        regressed = regressed || slower;
+        std::cerr << result.name << ": " << result.samplesPerSecond << " vs " << match->samplesPerSecond << " samples/s ("
+                  << (change >= 0.0 ? "+" : "") << change * 100.0 << "%)" << (slower ? " REGRESSION" : "") << std::endl;
+    }
+
+    if (regressed)
+    {
+        std::cerr << "Error: throughput regressed by more than " << threshold * 100.0 << "%" << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,292 @@
+#include "checkpoint.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <unistd.h>
+#include <utility>
+
+/*
+    file layout, native byte order:
+    magic, epoch, batch, learningRate, layer count,
+    per layer: activation type, weights rows, cols, data, bias rows, cols, data,
+    rng state length, rng state (text of operator<<), fnv-1a checksum of everything before
+*/
+
+namespace
+{
+    const char checkpointMagic[8] = {'M', 'L', 'C', 'K', 'P', 'T', '0', '1'};
+
+    uint32_t checksum(const char *data, size_t size)
+    {
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < size; i++)
+        {
+            hash ^= static_cast<unsigned char>(data[i]);
+            hash *= 16777619u;
+        }
+        return hash;
+    }
+
+    template <typename T>
+    void append(std::string *buffer, const T &value)
+    {
+        buffer->append(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+
+    void appendMatrix(std::string *buffer, const Matrix &matrix)
+    {
+        append(buffer, matrix.rows);
+        append(buffer, matrix.cols);
+        buffer->append(reinterpret_cast<const char *>(matrix.data.data()), matrix.data.size() * sizeof(float));
+    }
+
+    bool syncDirectory(const std::string &filename)
+    {
+        size_t slash = filename.rfind('/');
+        std::string directory = slash == std::string::npos ? "." : slash == 0 ? "/" : filename.substr(0, slash);
+
+        int descriptor = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+        if (descriptor < 0)
+            return false;
+        bool synced = fsync(descriptor) == 0;
+        return close(descriptor) == 0 && synced;
+    }
+
+    struct Reader
+    {
+        const std::string &buffer;
+        size_t position;
+
+        template <typename T>
+        bool read(T *value)
+        {
+            if (buffer.size() - position < sizeof(T))
+                return false;
+            std::memcpy(value, &buffer[position], sizeof(T));
+            position += sizeof(T);
+            return true;
+        }
+
+        bool readMatrix(Matrix *matrix)
+        {
+            uint rows, cols;
+            if (!read(&rows) || !read(&cols))
+                return false;
+
+            size_t bytes = static_cast<size_t>(rows) * cols * sizeof(float);
+            if (buffer.size() - position < bytes)
+                return false;
+
+            *matrix = Matrix(rows, cols);
+            std::memcpy(matrix->data.data(), &buffer[position], bytes);
+            position += bytes;
+            return true;
+        }
+    };
+}
+
+bool checkpointWrite(const Checkpoint &checkpoint, const std::string &filename)
+{
+    std::string buffer(checkpointMagic, sizeof(checkpointMagic));
+    append(&buffer, static_cast<int32_t>(checkpoint.state.epoch));
+    append(&buffer, static_cast<int32_t>(checkpoint.state.batch));
+    append(&buffer, checkpoint.state.learningRate);
+    append(&buffer, static_cast<uint32_t>(checkpoint.model.layers.size()));
+
+    for (const LayerSnapshot &layer : checkpoint.model.layers)
+    {
+        append(&buffer, static_cast<uint32_t>(layer.activationType));
+        appendMatrix(&buffer, layer.weights);
+        appendMatrix(&buffer, layer.bias);
+    }
+
+    std::ostringstream rng;
+    rng << checkpoint.rng;
+    append(&buffer, static_cast<uint32_t>(rng.str().size()));
+    buffer += rng.str();
+    append(&buffer, checksum(buffer.data(), buffer.size()));
+
+    std::string temp = filename + ".tmp";
+    FILE *file = std::fopen(temp.c_str(), "wb");
+    if (file == nullptr)
+    {
+        std::cerr << "Error: Could not write checkpoint " << filename << std::endl;
+        return false;
+    }
+
+    // the data has to be on disk before the rename makes it the checkpoint
+    bool written = std::fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+    written = std::fflush(file) == 0 && written;
+    written = fsync(fileno(file)) == 0 && written;
+    written = std::fclose(file) == 0 && written;
+
+    if (!written || std::rename(temp.c_str(), filename.c_str()) != 0)
+    {
+        std::cerr << "Error: Could not write checkpoint " << filename << std::endl;
+        std::remove(temp.c_str());
+        return false;
+    }
+
+    // the rename is an update of the directory, which has to reach the disk as well
+    if (!syncDirectory(filename))
+    {
+        std::cerr << "Error: Could not sync the directory of checkpoint " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool checkpointRead(const std::string &filename, Checkpoint *checkpoint)
+{
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open())
+        return false;
+
+    std::string buffer((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    uint32_t stored;
+    if (buffer.size() < sizeof(checkpointMagic) + sizeof(stored) || std::memcmp(buffer.data(), checkpointMagic, sizeof(checkpointMagic)) != 0)
+    {
+        std::cerr << "Error: " << filename << " is not a checkpoint" << std::endl;
+        return false;
+    }
+
+    size_t payload = buffer.size() - sizeof(stored);
+    std::memcpy(&stored, &buffer[payload], sizeof(stored));
+    if (stored != checksum(buffer.data(), payload))
+    {
+        std::cerr << "Error: checkpoint " << filename << " is corrupt" << std::endl;
+        return false;
+    }
+    buffer.resize(payload);
+
+    Reader reader{buffer, sizeof(checkpointMagic)};
+    int32_t epoch, batch;
+    uint32_t layerCount;
+    bool valid = reader.read(&epoch) && reader.read(&batch) && reader.read(&checkpoint->state.learningRate) && reader.read(&layerCount);
+
+    checkpoint->model.layers.resize(valid ? layerCount : 0);
+    for (LayerSnapshot &layer : checkpoint->model.layers)
+    {
+        uint32_t activationType = 0;
+        valid = valid && reader.read(&activationType) && reader.readMatrix(&layer.weights) && reader.readMatrix(&layer.bias);
+        if (valid)
+        {
+            layer.activationType = static_cast<ActivationType>(activationType);
+        }
+    }
+
+    uint32_t rngLength;
+    valid = valid && reader.read(&rngLength) && buffer.size() - reader.position == rngLength;
+    if (!valid)
+    {
+        std::cerr << "Error: checkpoint " << filename << " is corrupt" << std::endl;
+        return false;
+    }
+
+    std::istringstream rng(buffer.substr(reader.position));
+    rng >> checkpoint->rng;
+    checkpoint->state.epoch = epoch;
+    checkpoint->state.batch = batch;
+    return true;
+}
+
+Checkpointer::Checkpointer(const char *filename_) : filename(filename_)
+{
+    writer = std::thread(&Checkpointer::writerLoop, this);
+}
+
+Checkpointer::~Checkpointer()
+{
+    wait();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    condition.notify_all();
+    writer.join();
+}
+
+bool Checkpointer::save(Model *model, const TrainingState &state)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (busy)
+            return false;
+    }
+
+    // the writer only touches pending while busy
+    model->snapshot(&pending.model);
+    pending.state = state;
+    pending.rng = model->getRng();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::swap(pending, writing);
+        busy = true;
+    }
+    condition.notify_all();
+    return true;
+}
+
+void Checkpointer::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    condition.wait(lock, [this]
+                   { return !busy; });
+}
+
+bool Checkpointer::resume(Model *model, TrainingState *state)
+{
+    Checkpoint checkpoint;
+    if (!checkpointRead(filename, &checkpoint))
+        return false;
+
+    bool matches = checkpoint.model.layers.size() == static_cast<size_t>(model->getLayerCount());
+    for (int i = 0; matches && i < model->getLayerCount(); i++)
+    {
+        Layer *layer = model->getLayer(i);
+        const LayerSnapshot &saved = checkpoint.model.layers[i];
+        matches = saved.activationType == layer->getActivationType() &&
+                  saved.weights.rows == layer->getWeights()->rows && saved.weights.cols == layer->getWeights()->cols &&
+                  saved.bias.rows == layer->getBias()->rows && saved.bias.cols == layer->getBias()->cols;
+    }
+    if (!matches)
+    {
+        std::cerr << "Error: checkpoint " << filename << " does not match the model" << std::endl;
+        return false;
+    }
+
+    model->restore(checkpoint.model);
+    model->setRng(checkpoint.rng);
+    *state = checkpoint.state;
+    return true;
+}
+
+void Checkpointer::writerLoop()
+{
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [this]
+                           { return stop || busy; });
+            if (stop)
+                return;
+        }
+
+        {
+            AllocationScope scope("checkpoint");
+            checkpointWrite(writing, filename);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            busy = false;
+        }
+        condition.notify_all();
+    }
+}
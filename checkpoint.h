@@ -0,0 +1,67 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "matrix.h"
+#include "model.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+
+// position of the training loop, batch is the next batch to run in epoch
+struct TrainingState
+{
+    int epoch = 0;
+    int batch = 0;
+    float learningRate = 0.0f;
+};
+
+struct Checkpoint
+{
+    ModelSnapshot model;
+    TrainingState state;
+    std::mt19937 rng;
+};
+
+bool checkpointWrite(const Checkpoint &checkpoint, const std::string &filename);
+bool checkpointRead(const std::string &filename, Checkpoint *checkpoint);
+
+/*
+    periodically persists the training state of a model.
+
+    save() copies the parameters and the rng into a reused in-memory checkpoint and returns, a
+    background thread serializes it to <filename>.tmp, syncs it to disk, renames it over filename
+    and syncs the directory, so a crash leaves either the previous or the new checkpoint, never a
+    partial one.
+    while a write is running further saves are dropped, the training thread never waits.
+
+    resume() loads filename into a model of the same architecture, false if there is none.
+*/
+class Checkpointer
+{
+public:
+    explicit Checkpointer(const char *filename_);
+    ~Checkpointer();
+
+    bool save(Model *model, const TrainingState &state);
+    void wait();
+    bool resume(Model *model, TrainingState *state);
+
+private:
+    std::string filename;
+
+    Checkpoint pending;
+    Checkpoint writing;
+
+    std::thread writer;
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool busy = false;
+    bool stop = false;
+
+    void writerLoop();
+};
+
+#endif
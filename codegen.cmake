@@ -0,0 +1,17 @@
+# builds the files written by codegenExport (codegen.h) as a static library without any dependency
+# on this project, e.g.
+#
+#   include(path/to/codegen.cmake)
+#   ml_add_generated_model(mnist_model ${CMAKE_CURRENT_SOURCE_DIR}/mnist_model)
+#   target_link_libraries(app mnist_model)
+#
+# basename is the argument passed to codegenExport, the target gets its directory as include path
+function(ml_add_generated_model target basename)
+    get_filename_component(directory ${basename} DIRECTORY)
+    add_library(${target} STATIC ${basename}.cpp)
+    target_include_directories(${target} PUBLIC ${directory})
+    target_compile_features(${target} PUBLIC cxx_std_17) # hexfloat literals
+    if(CMAKE_CXX_COMPILER_ID MATCHES "GNU|Clang")
+        target_compile_options(${target} PRIVATE -O3)
+    endif()
+endfunction()
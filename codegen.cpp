@@ -0,0 +1,193 @@
+#include "codegen.h"
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <fstream>
+#include <iostream>
+
+namespace
+{
+    // generic kernels of the generated file, the compiler specializes them on the baked-in sizes
+    const char *generatedKernels = R"(namespace
+{
+    // out = weights * in + bias for one sample, weights row-major (rows x cols)
+    template <int rows, int cols>
+    inline void dense(const float *weights, const float *bias, const float *in, float *out)
+    {
+        for (int i = 0; i < rows; i++)
+        {
+            const float *w = weights + i * cols;
+
+            // independent lanes, the loop vectorizes without reassociating a single sum
+            float lane[8] = {};
+            int j = 0;
+            for (; j + 8 <= cols; j += 8)
+            {
+                for (int l = 0; l < 8; l++)
+                {
+                    lane[l] += w[j + l] * in[j + l];
+                }
+            }
+
+            float sum = bias[i];
+            for (; j < cols; j++)
+            {
+                sum += w[j] * in[j];
+            }
+            for (int l = 0; l < 8; l++)
+            {
+                sum += lane[l];
+            }
+            out[i] = sum;
+        }
+    }
+
+    template <int size>
+    inline void sigmoid(float *x)
+    {
+        for (int i = 0; i < size; i++)
+        {
+            x[i] = 1.0f / (1.0f + std::exp(-x[i]));
+        }
+    }
+
+    template <int size>
+    inline void relu(float *x)
+    {
+        for (int i = 0; i < size; i++)
+        {
+            x[i] = x[i] > 0.0f ? x[i] : 0.0f;
+        }
+    }
+
+    template <int size>
+    inline void softmax(float *x)
+    {
+        float max = x[0];
+        for (int i = 1; i < size; i++)
+        {
+            max = x[i] > max ? x[i] : max;
+        }
+
+        float expSum = 0.0f;
+        for (int i = 0; i < size; i++)
+        {
+            x[i] = std::exp(x[i] - max);
+            expSum += x[i];
+        }
+        for (int i = 0; i < size; i++)
+        {
+            x[i] /= expSum;
+        }
+    }
+}
+)";
+
+    const char *activationName(ActivationType type)
+    {
+        switch (type)
+        {
+        case ActivationType::SIGMOID:
+            return "sigmoid";
+        case ActivationType::RELU:
+            return "relu";
+        case ActivationType::SOFTMAX:
+            return "softmax";
+        }
+        return "";
+    }
+
+    void writeArray(std::ostream &out, const std::string &name, const Matrix &matrix)
+    {
+        out << "alignas(64) const float " << name << "[" << matrix.data.size() << "] = {";
+        for (size_t i = 0; i < matrix.data.size(); i++)
+        {
+            out << (i % 8 == 0 ? "\n    " : " ") << std::hexfloat << matrix.data[i] << std::defaultfloat << "f"
+                << (i + 1 < matrix.data.size() ? "," : "");
+        }
+        out << "};\n";
+    }
+}
+
+bool codegenExport(Model *model, const std::string &basename, const std::string &functionName)
+{
+    int layerCount = model->getLayerCount();
+    assert(layerCount > 0);
+
+    uint inputSize = model->getLayer(0)->getWeights()->cols;
+    uint outputSize = model->getLayer(layerCount - 1)->getWeights()->rows;
+    uint workspace = 0;
+    for (int i = 0; i < layerCount; i++)
+    {
+        workspace = std::max(workspace, model->getLayer(i)->getWeights()->rows);
+    }
+
+    // the include guard and prefix of the sizes come from the file name
+    std::string name = basename.substr(basename.find_last_of('/') + 1);
+    std::string guard = name;
+    std::transform(guard.begin(), guard.end(), guard.begin(), [](unsigned char c)
+                   { return std::isalnum(c) ? std::toupper(c) : '_'; });
+
+    std::ofstream header(basename + ".h");
+    std::ofstream source(basename + ".cpp");
+    if (!header.is_open() || !source.is_open())
+    {
+        std::cerr << "Error: Could not write " << basename << ".h / .cpp" << std::endl;
+        return false;
+    }
+
+    header << "// generated by codegenExport, do not edit\n"
+           << "#ifndef " << guard << "_H\n#define " << guard << "_H\n\n"
+           << "const int " << functionName << "InputSize = " << inputSize << ";\n"
+           << "const int " << functionName << "OutputSize = " << outputSize << ";\n\n"
+           << "// one sample: input[" << inputSize << "] features, output[" << outputSize << "] class probabilities\n"
+           << "void " << functionName << "(const float *input, float *output);\n\n"
+           << "#endif\n";
+
+    source << "// generated by codegenExport, do not edit\n"
+           << "#include \"" << name << ".h\"\n#include <cmath>\n\n"
+           << generatedKernels << "\n";
+
+    for (int i = 0; i < layerCount; i++)
+    {
+        Layer *layer = model->getLayer(i);
+        source << "// layer " << i << ": " << layer->getWeights()->cols << " -> " << layer->getWeights()->rows << ", "
+               << activationName(layer->getActivationType()) << "\n";
+        writeArray(source, "layer" + std::to_string(i) + "Weights", *layer->getWeights());
+        writeArray(source, "layer" + std::to_string(i) + "Bias", *layer->getBias());
+        source << "\n";
+    }
+
+    // ping-pong between two stack buffers, the last layer writes into output
+    source << "void " << functionName << "(const float *input, float *output)\n{\n"
+           << "    alignas(64) float a[" << workspace << "];\n";
+    if (layerCount > 2)
+    {
+        source << "    alignas(64) float b[" << workspace << "];\n";
+    }
+    source << "\n";
+
+    std::string in = "input";
+    for (int i = 0; i < layerCount; i++)
+    {
+        Layer *layer = model->getLayer(i);
+        std::string out = i + 1 == layerCount ? "output" : (i % 2 == 0 ? "a" : "b");
+        std::string layerName = "layer" + std::to_string(i);
+        uint rows = layer->getWeights()->rows;
+
+        source << "    dense<" << rows << ", " << layer->getWeights()->cols << ">(" << layerName << "Weights, " << layerName << "Bias, "
+               << in << ", " << out << ");\n"
+               << "    " << activationName(layer->getActivationType()) << "<" << rows << ">(" << out << ");\n";
+        in = out;
+    }
+    source << "}\n";
+
+    header.close();
+    source.close();
+    if (!header || !source)
+    {
+        std::cerr << "Error: Could not write " << basename << ".h / .cpp" << std::endl;
+        return false;
+    }
+    return true;
+}
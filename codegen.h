@@ -0,0 +1,20 @@
+#ifndef CODEGEN_H
+#define CODEGEN_H
+
+#include "model.h"
+
+#include <string>
+
+/*
+    ahead-of-time export of a trained model to standalone c++
+
+    writes <basename>.h and <basename>.cpp with a single entry point
+        void <functionName>(const float *input, float *output);
+    for one sample (input features in, class probabilities out). layer sizes are constants, the
+    weights static aligned arrays in hexfloat (bit exact), the activations are resolved at export
+    time. the generated code needs only <cmath>, allocates nothing and keeps its workspace on the
+    stack, so it is reentrant. build it with ml_add_generated_model from codegen.cmake.
+*/
+bool codegenExport(Model *model, const std::string &basename, const std::string &functionName = "predict");
+
+#endif
@@ -0,0 +1,379 @@
+#include "counters.h"
+#include "allocation.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+std::atomic<bool> counterCollection{false};
+
+namespace
+{
+    enum CounterEvent
+    {
+        CYCLES,
+        INSTRUCTIONS,
+        L1D_MISSES,
+        LLC_MISSES,
+        BRANCH_MISSES,
+        EVENT_COUNT
+    };
+
+    const char *eventNames[EVENT_COUNT] = {"cycles", "instructions", "L1d read misses", "LLC read misses", "branch misses"};
+    const double cacheLineBytes = 64.0;
+
+    struct KernelStats
+    {
+        unsigned long long calls = 0;
+        unsigned long long countedCalls[EVENT_COUNT] = {};
+        double seconds = 0.0;
+        double flops = 0.0;
+        double bytes = 0.0;
+        double counts[EVENT_COUNT] = {};
+        double countedFlops[EVENT_COUNT] = {}; // flops of the calls an event was counted in
+
+        void add(const KernelStats &other)
+        {
+            calls += other.calls;
+            seconds += other.seconds;
+            flops += other.flops;
+            bytes += other.bytes;
+            for (int e = 0; e < EVENT_COUNT; e++)
+            {
+                countedCalls[e] += other.countedCalls[e];
+                counts[e] += other.counts[e];
+                countedFlops[e] += other.countedFlops[e];
+            }
+        }
+    };
+
+    struct Collection
+    {
+        std::mutex mutex;
+        std::map<std::pair<std::string, std::string>, KernelStats> kernels; // (scope, kernel)
+        std::string unavailable;                                            // why no counter could be opened
+    };
+
+    Collection &collection()
+    {
+        static Collection *instance = new Collection();
+        return *instance;
+    }
+
+    // the event group of one thread, opened on its first instrumented kernel
+    struct ThreadCounters
+    {
+        bool opened = false;
+        int leader = -1;
+        int fds[EVENT_COUNT] = {-1, -1, -1, -1, -1};
+        uint64_t ids[EVENT_COUNT] = {};
+        uint depth = 0;
+
+        ~ThreadCounters()
+        {
+#ifdef __linux__
+            for (int fd : fds)
+            {
+                if (fd >= 0)
+                    close(fd);
+            }
+#endif
+        }
+    };
+
+    thread_local ThreadCounters threadCounters;
+
+    // counter values plus the time the group was enabled and running, for multiplexed groups
+    struct Sample
+    {
+        unsigned long long values[EVENT_COUNT] = {};
+        unsigned long long enabled = 0;
+        unsigned long long running = 0;
+    };
+
+    // errno of the first event that failed, 0 if at least one could be opened
+    int openCounters(ThreadCounters *counters)
+    {
+        counters->opened = true;
+#ifdef __linux__
+        const uint32_t types[EVENT_COUNT] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE};
+        const uint64_t configs[EVENT_COUNT] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+            PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+            PERF_COUNT_HW_BRANCH_MISSES};
+
+        int error = 0;
+        for (int e = 0; e < EVENT_COUNT; e++)
+        {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = types[e];
+            attr.config = configs[e];
+            attr.exclude_kernel = 1; // allowed with perf_event_paranoid 2
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+            int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, counters->leader, 0));
+            if (fd < 0)
+            {
+                if (error == 0)
+                    error = errno;
+                continue;
+            }
+            if (ioctl(fd, PERF_EVENT_IOC_ID, &counters->ids[e]) != 0)
+            {
+                close(fd);
+                continue;
+            }
+            counters->fds[e] = fd;
+            if (counters->leader < 0)
+                counters->leader = fd;
+        }
+        return counters->leader >= 0 ? 0 : (error != 0 ? error : ENOENT);
+#else
+        return ENOSYS;
+#endif
+    }
+
+    bool readCounters(ThreadCounters *counters, Sample *sample)
+    {
+#ifdef __linux__
+        if (counters->leader < 0)
+            return false;
+
+        // nr, time enabled, time running, then (value, id) per event of the group
+        uint64_t buffer[3 + 2 * EVENT_COUNT];
+        if (read(counters->leader, buffer, sizeof(buffer)) < static_cast<ssize_t>(3 * sizeof(uint64_t)))
+            return false;
+
+        sample->enabled = buffer[1];
+        sample->running = buffer[2];
+        for (uint64_t i = 0; i < buffer[0] && i < EVENT_COUNT; i++)
+        {
+            for (int e = 0; e < EVENT_COUNT; e++)
+            {
+                if (counters->fds[e] >= 0 && counters->ids[e] == buffer[4 + 2 * i])
+                    sample->values[e] = buffer[3 + 2 * i];
+            }
+        }
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    double now()
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // start of the outermost kernel of this thread
+    thread_local Sample startSample;
+    thread_local bool startValid = false;
+
+    // n/a for a denominator of 0 and a numerator < 0 (an event that was never counted)
+    std::string ratio(double numerator, double denominator, int precision)
+    {
+        if (denominator <= 0.0 || numerator < 0.0)
+            return "n/a";
+        std::ostringstream text;
+        text << std::fixed << std::setprecision(precision) << numerator / denominator;
+        return text.str();
+    }
+
+    void printRow(std::ostream &out, size_t width, const std::string &name, const KernelStats &stats)
+    {
+        double counts[EVENT_COUNT];
+        for (int e = 0; e < EVENT_COUNT; e++)
+        {
+            counts[e] = stats.countedCalls[e] > 0 ? stats.counts[e] : -1.0;
+        }
+
+        double kiloInstructions = counts[INSTRUCTIONS] / 1000.0;
+        out << std::left << std::setw(width) << name << std::right
+            << std::setw(10) << stats.calls
+            << std::setw(12) << ratio(stats.seconds * 1e3, 1.0, 2)
+            << std::setw(10) << ratio(stats.flops * 1e-9, stats.seconds, 2)
+            << std::setw(8) << ratio(counts[INSTRUCTIONS], counts[CYCLES], 2)
+            << std::setw(10) << ratio(counts[L1D_MISSES], kiloInstructions, 2)
+            << std::setw(10) << ratio(counts[LLC_MISSES], kiloInstructions, 2)
+            << std::setw(10) << ratio(counts[BRANCH_MISSES], kiloInstructions, 2)
+            << std::setw(10) << ratio(stats.bytes, stats.flops, 3)
+            << std::setw(12) << ratio(counts[LLC_MISSES] * cacheLineBytes, stats.countedFlops[LLC_MISSES], 3) << std::endl;
+    }
+}
+
+bool countersSetEnabled(bool enabled)
+{
+    bool available = true;
+    if (enabled)
+    {
+        // probe on the calling thread, other threads open their counters on their first kernel
+        ThreadCounters &counters = threadCounters;
+        int error = counters.opened ? (counters.leader >= 0 ? 0 : ENOENT) : openCounters(&counters);
+        if (error != 0)
+        {
+            Collection &state = collection();
+            std::lock_guard<std::mutex> lock(state.mutex);
+            state.unavailable = std::strerror(error);
+            available = false;
+        }
+    }
+
+    if (counterCollection.exchange(enabled, std::memory_order_relaxed) != enabled)
+    {
+        allocationRequireScopes(enabled);
+    }
+    return available;
+}
+
+void countersReset()
+{
+    Collection &state = collection();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    state.kernels.clear();
+}
+
+void countersReport(std::ostream &out)
+{
+    Collection &state = collection();
+    std::lock_guard<std::mutex> lock(state.mutex);
+
+    std::map<std::string, KernelStats> totals;
+    size_t width = 16;
+    for (auto &entry : state.kernels)
+    {
+        totals[entry.first.second].add(entry.second);
+        std::string scope = entry.first.first.empty() ? "(unscoped)" : entry.first.first;
+        width = std::max(width, scope.size() + entry.first.second.size() + 3);
+    }
+
+    std::ios::fmtflags flags = out.flags();
+    auto header = [&](const char *title)
+    {
+        out << std::left << std::setw(width) << title << std::right << std::setw(10) << "calls" << std::setw(12) << "ms"
+            << std::setw(10) << "GFLOP/s" << std::setw(8) << "IPC" << std::setw(10) << "L1d MPKI" << std::setw(10) << "LLC MPKI"
+            << std::setw(10) << "br MPKI" << std::setw(10) << "B/flop" << std::setw(12) << "LLC B/flop" << std::endl;
+    };
+
+    out << "kernel counters";
+    if (!state.unavailable.empty())
+    {
+        out << " (hardware counters unavailable: " << state.unavailable << ", wall time only)";
+    }
+    out << ":" << std::endl;
+    header("kernel");
+    for (auto &entry : totals)
+    {
+        printRow(out, width, entry.first, entry.second);
+    }
+
+    out << std::endl;
+    header("scope / kernel");
+    for (auto &entry : state.kernels)
+    {
+        std::string scope = entry.first.first.empty() ? "(unscoped)" : entry.first.first;
+        printRow(out, width, scope + " / " + entry.first.second, entry.second);
+    }
+
+    // events that never counted, e.g. no LLC event on this cpu
+    std::string missing;
+    for (int e = 0; e < EVENT_COUNT; e++)
+    {
+        bool counted = false;
+        for (auto &entry : totals)
+        {
+            counted = counted || entry.second.countedCalls[e] > 0;
+        }
+        if (!counted && state.unavailable.empty() && !totals.empty())
+        {
+            missing += missing.empty() ? eventNames[e] : std::string(", ") + eventNames[e];
+        }
+    }
+    if (!missing.empty())
+    {
+        out << "not counted on this host: " << missing << std::endl;
+    }
+    out.flags(flags);
+}
+
+KernelCounters::KernelCounters(const char *kernel_, double flops_, double bytes_) : entered(false),
+                                                                                     active(false),
+                                                                                     kernel(kernel_),
+                                                                                     flops(flops_),
+                                                                                     bytes(bytes_)
+{
+    if (!counterCollection.load(std::memory_order_relaxed))
+        return;
+
+    ThreadCounters &counters = threadCounters;
+    entered = true;
+    if (counters.depth++ > 0)
+        return;
+
+    active = true;
+    if (!counters.opened)
+    {
+        openCounters(&counters);
+    }
+    startValid = readCounters(&counters, &startSample);
+    startTime = now();
+}
+
+KernelCounters::~KernelCounters()
+{
+    if (!entered)
+        return;
+
+    ThreadCounters &counters = threadCounters;
+    counters.depth--;
+    if (!active)
+        return;
+
+    double seconds = now() - startTime;
+    Sample end;
+    bool endValid = startValid && readCounters(&counters, &end);
+
+    KernelStats call;
+    call.calls = 1;
+    call.seconds = seconds;
+    call.flops = flops;
+    call.bytes = bytes;
+
+    // a multiplexed group only counted part of the call, scale by enabled / running time
+    unsigned long long running = endValid ? end.running - startSample.running : 0;
+    if (running > 0)
+    {
+        double scale = static_cast<double>(end.enabled - startSample.enabled) / running;
+        for (int e = 0; e < EVENT_COUNT; e++)
+        {
+            if (counters.fds[e] < 0)
+                continue;
+            call.counts[e] = static_cast<double>(end.values[e] - startSample.values[e]) * scale;
+            call.countedCalls[e] = 1;
+            call.countedFlops[e] = flops;
+        }
+    }
+
+    Collection &state = collection();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    state.kernels[std::make_pair(allocationScopePath(), std::string(kernel))].add(call);
+}
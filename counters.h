@@ -0,0 +1,50 @@
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+#include <atomic>
+#include <ostream>
+
+/*
+    opt-in hardware performance counters per kernel
+
+    while collection is enabled, the instrumented kernels of matrix.cpp read cycles, instructions,
+    L1d and last level cache read misses and branch misses of the calling thread (perf_event_open)
+    around their body and add them, together with the wall time and the nominal flops and bytes of
+    the call, to the kernel under the current phase / layer (AllocationScope). nested kernels are
+    counted once, by the outermost one; threads a kernel starts itself are not counted.
+    events the kernel or the hardware do not provide (perf_event_paranoid, containers, VMs without a
+    PMU) are reported as n/a, the wall time is always measured. disabled, a kernel costs a call and one
+    relaxed load.
+*/
+
+extern std::atomic<bool> counterCollection;
+
+// false if no hardware counter can be opened on this host, wall time is collected anyway
+bool countersSetEnabled(bool enabled);
+void countersReset();
+
+// per kernel over all scopes, then per scope and kernel: calls, time, IPC, misses per 1000
+// instructions, nominal bytes / flop and last level cache miss bytes / flop
+void countersReport(std::ostream &out);
+
+// counts the enclosing block as one call of kernel; flops counts a multiply-add as 2 and an
+// elementwise function as 1 per element, bytes the operands read and written once
+class KernelCounters
+{
+public:
+    KernelCounters(const char *kernel_, double flops_, double bytes_);
+    ~KernelCounters();
+
+    KernelCounters(const KernelCounters &) = delete;
+    KernelCounters &operator=(const KernelCounters &) = delete;
+
+private:
+    bool entered; // counted in the nesting depth of this thread
+    bool active;  // outermost kernel of the thread, measured
+    const char *kernel;
+    double flops;
+    double bytes;
+    double startTime = 0.0;
+};
+
+#endif
@@ -0,0 +1,402 @@
+#include "dataparallel.h"
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <linux/futex.h>
+#include <map>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+struct SharedAllReduce::Header
+{
+    uint32_t magic;
+    uint32_t processes;
+    uint64_t capacity;
+    alignas(64) std::atomic<uint32_t> arrived;
+    alignas(64) std::atomic<uint32_t> generation;
+};
+
+namespace
+{
+    const uint32_t sharedMagic = 0x4d4c4152; // "MLAR"
+    const double attachTimeout = 30.0;       // seconds rank 0 has to create the segment
+    const double barrierTimeout = 300.0;     // seconds until a missing process is reported
+
+    // not FUTEX_PRIVATE_FLAG, the word is shared between processes
+    long futexWait(std::atomic<uint32_t> *word, uint32_t expected, const timespec *timeout)
+    {
+        return syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAIT, expected, timeout, nullptr, 0);
+    }
+
+    long futexWake(std::atomic<uint32_t> *word)
+    {
+        return syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    }
+
+    size_t alignUp(size_t bytes)
+    {
+        return (bytes + 63) / 64 * 64;
+    }
+}
+
+SharedAllReduce::SharedAllReduce(const std::string &name_, uint rank_, uint processes_, size_t capacity_) : name("/" + name_),
+                                                                                                           rank(rank_),
+                                                                                                           processes(processes_),
+                                                                                                           capacity(capacity_)
+{
+    assert(rank < processes && processes > 0);
+
+    size_t slotBytes = alignUp(capacity * sizeof(float));
+    bytes = alignUp(sizeof(Header)) + (processes + 1) * slotBytes;
+
+    int fd = -1;
+    if (rank == 0)
+    {
+        shm_unlink(name.c_str());
+        fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd >= 0 && ftruncate(fd, bytes) != 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    else
+    {
+        // wait until rank 0 has created and sized the segment
+        auto start = std::chrono::steady_clock::now();
+        while (std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() < attachTimeout)
+        {
+            fd = shm_open(name.c_str(), O_RDWR, 0600);
+            struct stat status;
+            if (fd >= 0 && fstat(fd, &status) == 0 && static_cast<size_t>(status.st_size) == bytes)
+                break;
+            if (fd >= 0)
+                close(fd);
+            fd = -1;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+    if (fd < 0)
+    {
+        std::cerr << "Error: Could not open shared memory " << name << " (" << std::strerror(errno) << ")" << std::endl;
+        return;
+    }
+
+    mapping = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        std::cerr << "Error: Could not map shared memory " << name << std::endl;
+        mapping = nullptr;
+        return;
+    }
+
+    header = static_cast<Header *>(mapping);
+    slots = reinterpret_cast<float *>(static_cast<char *>(mapping) + alignUp(sizeof(Header)));
+    result = slots + processes * (slotBytes / sizeof(float));
+    capacity = slotBytes / sizeof(float);
+
+    // the new segment is zero filled, the others may already wait in the barrier below
+    if (rank == 0)
+    {
+        header->processes = processes;
+        header->capacity = capacity;
+        header->magic = sharedMagic;
+    }
+
+    // the first barrier also makes the header visible to everyone
+    if (!barrier() || header->magic != sharedMagic || header->processes != processes || header->capacity != capacity)
+    {
+        std::cerr << "Error: shared memory " << name << " does not match this group" << std::endl;
+        munmap(mapping, bytes);
+        mapping = nullptr;
+        header = nullptr;
+    }
+}
+
+SharedAllReduce::~SharedAllReduce()
+{
+    if (mapping != nullptr)
+    {
+        munmap(mapping, bytes);
+    }
+    if (rank == 0)
+    {
+        shm_unlink(name.c_str());
+    }
+}
+
+bool SharedAllReduce::isOpen()
+{
+    return header != nullptr;
+}
+
+bool SharedAllReduce::barrier()
+{
+    if (mapping == nullptr)
+        return false;
+
+    uint32_t generation = header->generation.load(std::memory_order_acquire);
+    if (header->arrived.fetch_add(1, std::memory_order_acq_rel) + 1 == processes)
+    {
+        header->arrived.store(0, std::memory_order_relaxed);
+        header->generation.fetch_add(1, std::memory_order_release);
+        futexWake(&header->generation);
+        return true;
+    }
+
+    // spin briefly, the other processes are usually close, then sleep on the futex
+    for (int spin = 0; spin < 1000; spin++)
+    {
+        if (header->generation.load(std::memory_order_acquire) != generation)
+            return true;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    timespec timeout = {0, 100 * 1000 * 1000};
+    while (header->generation.load(std::memory_order_acquire) == generation)
+    {
+        futexWait(&header->generation, generation, &timeout);
+        if (std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() > barrierTimeout)
+        {
+            std::cerr << "Error: timed out waiting for the other processes of " << name << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool SharedAllReduce::allReduce(const std::vector<std::pair<float *, size_t>> &parts)
+{
+    if (!isOpen())
+        return false;
+
+    float *slot = slots + rank * capacity;
+    size_t total = 0;
+    for (const std::pair<float *, size_t> &part : parts)
+    {
+        assert(total + part.second <= capacity);
+        std::copy(part.first, part.first + part.second, slot + total);
+        total += part.second;
+    }
+
+    if (!barrier())
+        return false;
+
+    // reduce-scatter: every process sums its chunk over all slots, always in rank order
+    size_t chunk = (total + processes - 1) / processes;
+    size_t begin = std::min(total, rank * chunk);
+    size_t end = std::min(total, begin + chunk);
+    float scale = 1.0f / static_cast<float>(processes);
+    for (size_t i = begin; i < end; i++)
+    {
+        float sum = 0.0f;
+        for (uint p = 0; p < processes; p++)
+        {
+            sum += slots[p * capacity + i];
+        }
+        result[i] = sum * scale;
+    }
+
+    if (!barrier())
+        return false;
+
+    // all-gather, result is not written again before every process wrote its next slot
+    total = 0;
+    for (const std::pair<float *, size_t> &part : parts)
+    {
+        std::copy(result + total, result + total + part.second, part.first);
+        total += part.second;
+    }
+    return true;
+}
+
+bool SharedAllReduce::broadcast(const std::vector<std::pair<float *, size_t>> &parts)
+{
+    if (!isOpen())
+        return false;
+
+    size_t total = 0;
+    if (rank == 0)
+    {
+        for (const std::pair<float *, size_t> &part : parts)
+        {
+            assert(total + part.second <= capacity);
+            std::copy(part.first, part.first + part.second, result + total);
+            total += part.second;
+        }
+    }
+
+    if (!barrier())
+        return false;
+
+    total = 0;
+    for (const std::pair<float *, size_t> &part : parts)
+    {
+        if (rank != 0)
+            std::copy(result + total, result + total + part.second, part.first);
+        total += part.second;
+    }
+
+    // nobody may write result before every process has read it
+    return barrier();
+}
+
+namespace
+{
+    size_t parameterCount(Model *model)
+    {
+        size_t count = 1; // loss
+        for (int i = 0; i < model->getLayerCount(); i++)
+        {
+            count += model->getLayer(i)->getWeights()->data.size() + model->getLayer(i)->getBias()->data.size();
+        }
+        return count;
+    }
+}
+
+DataParallel::DataParallel(Model *model_, const std::string &name, uint rank_, uint processes_) : model(model_),
+                                                                                                 rank(rank_),
+                                                                                                 processes(processes_),
+                                                                                                 reduce(name, rank_, processes_, parameterCount(model_))
+{
+}
+
+bool DataParallel::isOpen()
+{
+    return reduce.isOpen();
+}
+
+uint DataParallel::getRank()
+{
+    return rank;
+}
+
+uint DataParallel::getProcessCount()
+{
+    return processes;
+}
+
+bool DataParallel::forwardBackward(Matrix *data, Matrix *labels, float *loss)
+{
+    model->forwardBackward(data, labels, &localLoss);
+
+    std::vector<std::pair<float *, size_t>> parts;
+    for (int i = 0; i < model->getLayerCount(); i++)
+    {
+        Layer *layer = model->getLayer(i);
+        assert(layer->getGradWeights() != nullptr); // needs Model::initTraining
+        parts.push_back({layer->getGradWeights()->data.data(), layer->getGradWeights()->data.size()});
+        parts.push_back({layer->getGradBias()->data.data(), layer->getGradBias()->data.size()});
+    }
+    parts.push_back({&localLoss, 1});
+
+    bool reduced = reduce.allReduce(parts);
+    *loss = localLoss;
+    return reduced;
+}
+
+bool DataParallel::broadcastParameters()
+{
+    std::vector<std::pair<float *, size_t>> parts;
+    for (int i = 0; i < model->getLayerCount(); i++)
+    {
+        Layer *layer = model->getLayer(i);
+        parts.push_back({layer->getWeights()->data.data(), layer->getWeights()->data.size()});
+        parts.push_back({layer->getBias()->data.data(), layer->getBias()->data.size()});
+    }
+    if (!reduce.broadcast(parts))
+        return false;
+
+    for (int i = 0; i < model->getLayerCount(); i++)
+    {
+        model->getLayer(i)->weightsChanged();
+    }
+    return true;
+}
+
+int dataParallelLaunch(uint processes, const std::function<int(uint)> &worker)
+{
+    assert(processes > 0);
+
+    std::vector<pid_t> children;
+    for (uint rank = 1; rank < processes; rank++)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            // no destructors of the parent's objects in the child
+            std::cout.flush();
+            _exit(worker(rank));
+        }
+        if (pid < 0)
+        {
+            std::cerr << "Error: Could not start worker " << rank << std::endl;
+            break;
+        }
+        children.push_back(pid);
+    }
+
+    // with a missing worker the others time out in their first barrier
+    int result = children.size() + 1 == processes ? worker(0) : 1;
+
+    for (pid_t child : children)
+    {
+        int status = 0;
+        if (waitpid(child, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            result = 1;
+        }
+    }
+    return result;
+}
+
+void dataParallelPin(uint rank, uint processes)
+{
+    // cpus per physical package from sysfs
+    std::map<int, std::vector<int>> sockets;
+    uint cpus = std::max(1u, std::thread::hardware_concurrency());
+    for (uint cpu = 0; cpu < cpus; cpu++)
+    {
+        std::ifstream file("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/physical_package_id");
+        int socket = 0;
+        file >> socket;
+        sockets[socket].push_back(cpu);
+    }
+
+    std::vector<int> mine;
+    if (sockets.size() >= processes)
+    {
+        mine = std::next(sockets.begin(), rank % sockets.size())->second;
+    }
+    else
+    {
+        uint share = std::max(1u, cpus / processes);
+        for (uint cpu = rank * share % cpus; mine.size() < share; cpu = (cpu + 1) % cpus)
+        {
+            mine.push_back(cpu);
+        }
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : mine)
+    {
+        CPU_SET(cpu, &set);
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+    {
+        std::cerr << "Error: Could not pin process " << rank << " (" << std::strerror(errno) << ")" << std::endl;
+    }
+}
@@ -0,0 +1,83 @@
+#ifndef DATAPARALLEL_H
+#define DATAPARALLEL_H
+
+#include "model.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+    multi-process data-parallel training on one host
+
+    every process trains a replica of the model on its own shard of the batches. after the local
+    forward / backward, gradweights and gradbias of all layers are averaged over the processes through
+    a POSIX shared memory segment (shm_open): every process writes its gradients into its own slot,
+    reduces a 1/processes chunk of all slots into the shared result (reduce-scatter) and copies the
+    whole result back (all-gather). the phases are separated by a barrier on a futex in the segment,
+    so waiting processes sleep in the kernel instead of spinning. all processes read the same sums
+    in the same order, their weights stay bit-identical without ever being exchanged.
+*/
+
+// sum of the slots / processes, shared by all processes of a group
+class SharedAllReduce
+{
+public:
+    // rank 0 creates the segment /<name>, the others attach to it; capacity in floats
+    SharedAllReduce(const std::string &name_, uint rank_, uint processes_, size_t capacity_);
+    ~SharedAllReduce();
+
+    bool isOpen();
+    bool allReduce(const std::vector<std::pair<float *, size_t>> &parts); // averages parts over all processes
+    bool broadcast(const std::vector<std::pair<float *, size_t>> &parts); // parts of rank 0 to all processes
+    bool barrier();
+
+private:
+    struct Header;
+
+    std::string name;
+    uint rank;
+    uint processes;
+    size_t capacity;
+    size_t bytes = 0;
+    void *mapping = nullptr;
+
+    Header *header = nullptr;
+    float *slots = nullptr; // processes x capacity
+    float *result = nullptr;
+};
+
+class DataParallel
+{
+public:
+    DataParallel(Model *model_, const std::string &name, uint rank_, uint processes_);
+
+    bool isOpen();
+    uint getRank();
+    uint getProcessCount();
+
+    // local gradients of this process's batch, then the gradients and the loss averaged over all processes
+    bool forwardBackward(Matrix *data, Matrix *labels, float *loss);
+    bool broadcastParameters(); // weights and biases of rank 0 to all processes
+
+private:
+    Model *model;
+    uint rank;
+    uint processes;
+    SharedAllReduce reduce;
+    float localLoss = 0.0f;
+};
+
+// forks processes - 1 workers, runs worker(rank) in every process (rank 0 in the caller) and waits for
+// all of them; call it before any thread is started. returns 0 if every worker returned 0
+int dataParallelLaunch(uint processes, const std::function<int(uint)> &worker);
+
+// restricts the calling process to the cpus of one socket (rank % sockets), or to an even share of the
+// cpus if there are fewer sockets than processes
+void dataParallelPin(uint rank, uint processes);
+
+#endif
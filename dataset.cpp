@@ -0,0 +1,528 @@
+#include "dataset.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+ChunkedDataset::ChunkedDataset(const char *filename_, uint featureCount_, size_t memoryBudget_, uint shuffleWindow_, uint seed_) : file(filename_),
+                                                                                                                                   filename(filename_),
+                                                                                                                                   featureCount(featureCount_),
+                                                                                                                                   shuffleWindow(shuffleWindow_ > 0 ? shuffleWindow_ : 1)
+{
+    if (!file.is_open())
+    {
+        std::cerr << "Error: Could not open file " << filename_ << std::endl;
+        shardSize = 0;
+        return;
+    }
+
+    if (seed_ == 0)
+    {
+        std::random_device dev;
+        seed_ = dev();
+    }
+    rng.seed(seed_);
+
+    // current window + read-ahead window + the shard the reader is filling
+    size_t bytesPerSample = static_cast<size_t>(featureCount + 1) * sizeof(float);
+    size_t shards = 2 * static_cast<size_t>(shuffleWindow) + 1;
+    shardSize = static_cast<uint>(memoryBudget_ / (shards * bytesPerSample));
+    if (shardSize == 0)
+    {
+        std::cerr << "Warning: memory budget of " << memoryBudget_ << " bytes is too small, using one sample per shard" << std::endl;
+        shardSize = 1;
+    }
+
+    // count samples once so the training loop knows the epoch length
+    std::vector<char> buffer(1 << 20);
+    char last = '\n';
+    while (file)
+    {
+        file.read(buffer.data(), buffer.size());
+        std::streamsize n = file.gcount();
+        sampleCount += static_cast<uint>(std::count(buffer.data(), buffer.data() + n, '\n'));
+        if (n > 0)
+            last = buffer[n - 1];
+    }
+    if (last != '\n')
+        sampleCount++;
+
+    file.clear();
+    file.seekg(0);
+    startReader();
+}
+
+ChunkedDataset::~ChunkedDataset()
+{
+    stopReaderThread();
+}
+
+bool ChunkedDataset::isOpen()
+{
+    return shardSize > 0;
+}
+
+uint ChunkedDataset::getSampleCount()
+{
+    return sampleCount;
+}
+
+uint ChunkedDataset::getShardSize()
+{
+    return shardSize;
+}
+
+bool ChunkedDataset::hasError()
+{
+    return readError;
+}
+
+void ChunkedDataset::setNormalization(const Normalization &normalization_)
+{
+    normalization = normalization_;
+}
+
+void ChunkedDataset::reset()
+{
+    stopReaderThread();
+
+    queue.clear();
+    window.clear();
+    order.clear();
+    orderPosition = 0;
+    endOfFile = false;
+
+    file.clear();
+    file.seekg(dataStart);
+    lineNumber = dataStartLine;
+    shardIndex = 0;
+    readError = false;
+    startReader();
+}
+
+bool ChunkedDataset::nextBatch(Matrix *batch, Matrix *labels)
+{
+    // batch[feature][sample], labels[0][sample] holds the class index
+    assert(batch->rows == featureCount);
+    assert(labels->rows == 1 && labels->cols == batch->cols);
+
+    if (!isOpen())
+        return false;
+
+    float scale = normalization.scale / normalization.std;
+    float offset = -normalization.mean / normalization.std;
+
+    for (uint j = 0; j < batch->cols; j++)
+    {
+        if (orderPosition == order.size() && !fillWindow())
+        {
+            return false;
+        }
+
+        std::pair<uint, uint> index = order[orderPosition++];
+        Shard &shard = window[index.first];
+        const float *sample = &shard.features[static_cast<size_t>(index.second) * featureCount];
+
+        for (uint i = 0; i < featureCount; i++)
+        {
+            batch->data[static_cast<size_t>(i) * batch->cols + j] = sample[i] * scale + offset;
+        }
+        labels->data[j] = shard.labels[index.second];
+    }
+
+    return true;
+}
+
+bool ChunkedDataset::holdOut(uint count, Matrix *data, Matrix *labels)
+{
+    assert(data->rows == featureCount && data->cols == count);
+    assert(labels->rows == 1 && labels->cols == count);
+
+    if (!isOpen())
+        return false;
+    if (count >= sampleCount)
+    {
+        std::cerr << "Error: cannot hold out " << count << " of " << sampleCount << " samples" << std::endl;
+        return false;
+    }
+
+    stopReaderThread();
+    file.clear();
+    file.seekg(dataStart);
+    lineNumber = dataStartLine;
+    shardIndex = 0;
+    readError = false;
+
+    // one shard of count samples, read on this thread
+    Shard shard;
+    uint streamShardSize = shardSize;
+    shardSize = count;
+    readShard(&shard);
+    shardSize = streamShardSize;
+
+    if (readError || shard.samples < count)
+    {
+        std::cerr << "Error: could only read " << shard.samples << " of " << count << " held out samples" << std::endl;
+        reset();
+        return false;
+    }
+
+    float scale = normalization.scale / normalization.std;
+    float offset = -normalization.mean / normalization.std;
+
+    for (uint j = 0; j < count; j++)
+    {
+        const float *sample = &shard.features[static_cast<size_t>(j) * featureCount];
+        for (uint i = 0; i < featureCount; i++)
+        {
+            data->data[static_cast<size_t>(i) * count + j] = sample[i] * scale + offset;
+        }
+        labels->data[j] = shard.labels[j];
+    }
+
+    dataStart = file.tellg();
+    dataStartLine = lineNumber;
+    sampleCount -= count;
+    reset();
+    return true;
+}
+
+void ChunkedDataset::startReader()
+{
+    stopReader = false;
+    reader = std::thread(&ChunkedDataset::readerLoop, this);
+}
+
+void ChunkedDataset::stopReaderThread()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopReader = true;
+    }
+    condition.notify_all();
+
+    if (reader.joinable())
+    {
+        reader.join();
+    }
+}
+
+void ChunkedDataset::readerLoop()
+{
+    while (true)
+    {
+        Shard shard;
+        bool more = readShard(&shard);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [this]
+                       { return stopReader || queue.size() < shuffleWindow; });
+        if (stopReader)
+            return;
+
+        if (shard.samples > 0)
+            queue.push_back(std::move(shard));
+
+        if (!more)
+        {
+            // an empty shard marks the end of the file
+            queue.push_back(Shard());
+            condition.notify_all();
+            return;
+        }
+        condition.notify_all();
+    }
+}
+
+bool ChunkedDataset::readShard(Shard *shard)
+{
+    shard->features.assign(static_cast<size_t>(shardSize) * featureCount, 0.0f);
+    shard->labels.assign(shardSize, 0.0f);
+
+    std::string line;
+    while (shard->samples < shardSize && std::getline(file, line))
+    {
+        lineNumber++;
+        const char *begin = line.c_str();
+        char *end = nullptr;
+
+        float label = std::strtof(begin, &end);
+        if (end == begin)
+            continue; // empty line
+
+        float *sample = &shard->features[static_cast<size_t>(shard->samples) * featureCount];
+        for (uint i = 0; i < featureCount; i++)
+        {
+            begin = end;
+            sample[i] = std::strtof(begin, &end);
+            if (end == begin)
+            {
+                // a short line ends the stream instead of training on zero-filled features
+                std::cerr << "Error: line " << lineNumber << " of " << filename << " (shard " << shardIndex << ") has " << i
+                          << " of " << featureCount << " features" << std::endl;
+                readError = true;
+                shard->samples = 0;
+                shard->features.clear();
+                shard->labels.clear();
+                return false;
+            }
+        }
+
+        shard->labels[shard->samples] = label;
+        shard->samples++;
+    }
+
+    shard->features.resize(static_cast<size_t>(shard->samples) * featureCount);
+    shard->labels.resize(shard->samples);
+    shardIndex++;
+
+    return shard->samples == shardSize;
+}
+
+bool ChunkedDataset::fillWindow()
+{
+    window.clear();
+    order.clear();
+    orderPosition = 0;
+
+    while (window.size() < shuffleWindow && !endOfFile)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [this]
+                       { return !queue.empty(); });
+
+        Shard shard = std::move(queue.front());
+        queue.pop_front();
+        condition.notify_all();
+
+        if (shard.samples == 0)
+        {
+            endOfFile = true;
+            break;
+        }
+        window.push_back(std::move(shard));
+    }
+
+    for (uint s = 0; s < window.size(); s++)
+    {
+        for (uint i = 0; i < window[s].samples; i++)
+        {
+            order.push_back(std::make_pair(s, i));
+        }
+    }
+    std::shuffle(order.begin(), order.end(), rng);
+
+    return !order.empty();
+}
+
+namespace
+{
+    // samples per feature-major panel of ByteDataset
+    const uint panelSamples = 256;
+
+    // in: rows x cols, out: cols x rows, in 32 x 32 tiles like matrixTranspose
+    void transposeBytes(const uint8_t *in, uint rows, uint cols, uint8_t *out)
+    {
+        const uint tile = 32;
+        for (uint i0 = 0; i0 < cols; i0 += tile)
+        {
+            uint i1 = std::min(i0 + tile, cols);
+            for (uint j0 = 0; j0 < rows; j0 += tile)
+            {
+                uint j1 = std::min(j0 + tile, rows);
+                for (uint i = i0; i < i1; i++)
+                {
+                    for (uint j = j0; j < j1; j++)
+                    {
+                        out[static_cast<size_t>(i) * rows + j] = in[static_cast<size_t>(j) * cols + i];
+                    }
+                }
+            }
+        }
+    }
+}
+
+ByteDataset::ByteDataset(const char *filename, uint featureCount_) : featureCount(featureCount_)
+{
+    std::ifstream file(filename);
+    if (!file.is_open())
+    {
+        std::cerr << "Error: Could not open file " << filename << std::endl;
+        return;
+    }
+
+    std::cout << "loading dataset ..." << std::endl;
+
+    // count the lines first so the storage is allocated once at its final size, growing it by
+    // doubling and shrinking it afterwards would need twice the dataset at the peak
+    size_t lines = 0;
+    {
+        std::vector<char> buffer(1 << 20);
+        char last = '\n';
+        while (file)
+        {
+            file.read(buffer.data(), buffer.size());
+            std::streamsize n = file.gcount();
+            lines += static_cast<size_t>(std::count(buffer.data(), buffer.data() + n, '\n'));
+            if (n > 0)
+                last = buffer[n - 1];
+        }
+        if (last != '\n')
+            lines++;
+        file.clear();
+        file.seekg(0);
+    }
+    features.reserve(lines * featureCount);
+    labels.reserve(lines);
+
+    // parsed straight into uint8, no float copy of the file is made. a panel of samples is staged
+    // in cache and transposed into the feature-major storage when it is full
+    std::vector<uint8_t> staging(static_cast<size_t>(panelSamples) * featureCount);
+    uint staged = 0;
+    auto flush = [&]()
+    {
+        size_t offset = features.size();
+        features.resize(offset + static_cast<size_t>(staged) * featureCount);
+        transposeBytes(staging.data(), staged, featureCount, &features[offset]);
+        staged = 0;
+    };
+
+    std::string line;
+    while (std::getline(file, line))
+    {
+        const char *begin = line.c_str();
+        char *end = nullptr;
+
+        long label = std::strtol(begin, &end, 10);
+        if (end == begin)
+            continue; // empty line
+
+        if (label < 0 || label > 255)
+        {
+            std::cerr << "Error: label " << label << " of sample " << sampleCount << " in " << filename << " is out of range" << std::endl;
+            return;
+        }
+        labels.push_back(static_cast<uint8_t>(label));
+
+        uint8_t *sample = &staging[static_cast<size_t>(staged) * featureCount];
+        for (uint i = 0; i < featureCount; i++)
+        {
+            begin = end;
+            long value = std::strtol(begin, &end, 10);
+            if (end == begin || value < 0 || value > 255)
+            {
+                std::cerr << "Error: feature " << i << " of sample " << sampleCount << " in " << filename << " is not a byte" << std::endl;
+                return;
+            }
+            sample[i] = static_cast<uint8_t>(value);
+        }
+        sampleCount++;
+
+        if (++staged == panelSamples)
+        {
+            flush();
+        }
+    }
+    flush();
+
+    // only empty lines leave the reserved storage larger than the samples
+    if (features.capacity() != features.size())
+    {
+        features.shrink_to_fit();
+        labels.shrink_to_fit();
+    }
+    open = true;
+}
+
+bool ByteDataset::isOpen()
+{
+    return open;
+}
+
+uint ByteDataset::getSampleCount()
+{
+    return sampleCount;
+}
+
+uint ByteDataset::getFeatureCount()
+{
+    return featureCount;
+}
+
+size_t ByteDataset::getMemoryUsage()
+{
+    return features.capacity() + labels.capacity();
+}
+
+Normalization ByteDataset::standardization(float scale)
+{
+    // byte histogram instead of a pass in float over every value
+    std::vector<size_t> histogram(256, 0);
+    for (uint8_t value : features)
+    {
+        histogram[value]++;
+    }
+
+    double sum = 0.0;
+    double squares = 0.0;
+    for (uint v = 0; v < 256; v++)
+    {
+        double x = v * static_cast<double>(scale);
+        sum += histogram[v] * x;
+        squares += histogram[v] * x * x;
+    }
+
+    Normalization normalization;
+    normalization.scale = scale;
+    if (!features.empty())
+    {
+        double mean = sum / features.size();
+        double variance = squares / features.size() - mean * mean;
+        normalization.mean = static_cast<float>(mean);
+        normalization.std = variance > 0.0 ? static_cast<float>(std::sqrt(variance)) : 1.0f;
+    }
+    return normalization;
+}
+
+void ByteDataset::assembleBatch(uint first, uint count, const Normalization &normalization, Matrix *batch, Matrix *labels_)
+{
+    assert(first + count <= sampleCount);
+    assert(batch->rows == featureCount && batch->cols == count);
+    assert(labels_ == nullptr || (labels_->rows == 1 && labels_->cols == count));
+
+    float scale = normalization.scale / normalization.std;
+    float offset = -normalization.mean / normalization.std;
+
+    // the storage is feature-major within each panel, so the batch is a contiguous run of every
+    // feature row per panel touched
+    for (uint j = 0; j < count;)
+    {
+        uint sample = first + j;
+        uint panel = sample / panelSamples;
+        uint position = sample % panelSamples;
+        uint width = std::min(panelSamples, sampleCount - panel * panelSamples);
+        uint run = std::min(width - position, count - j);
+        const uint8_t *panelData = &features[static_cast<size_t>(panel) * panelSamples * featureCount];
+
+        for (uint i = 0; i < featureCount; i++)
+        {
+            const uint8_t *in = &panelData[static_cast<size_t>(i) * width + position];
+            float *out = &batch->data[static_cast<size_t>(i) * count + j];
+            for (uint k = 0; k < run; k++)
+            {
+                out[k] = in[k] * scale + offset;
+            }
+        }
+        j += run;
+    }
+
+    if (labels_ != nullptr)
+    {
+        for (uint j = 0; j < count; j++)
+        {
+            labels_->data[j] = labels[first + j];
+        }
+    }
+}
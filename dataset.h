@@ -0,0 +1,124 @@
+#ifndef DATASET_H
+#define DATASET_H
+
+#include "matrix.h"
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// feature value = (x * scale - mean) / std
+struct Normalization
+{
+    float scale = 1.0f;
+    float mean = 0.0f;
+    float std = 1.0f;
+};
+
+/*
+    streams a dataset file (one sample per line, label first) from disk in fixed-size shards.
+    a background thread reads the next window of shards while the current window is consumed,
+    samples are shuffled within a window. at most 2 * shuffleWindow + 1 shards are resident,
+    the shard size is derived from memoryBudget (bytes).
+*/
+class ChunkedDataset
+{
+public:
+    ChunkedDataset(const char *filename_, uint featureCount_, size_t memoryBudget_, uint shuffleWindow_ = 1, uint seed_ = 0);
+    ~ChunkedDataset();
+
+    bool isOpen();
+    uint getSampleCount();
+    uint getShardSize();
+    bool hasError(); // a malformed line ended the stream, nextBatch returned false early
+
+    void setNormalization(const Normalization &normalization_);
+    void reset();
+    bool nextBatch(Matrix *batch, Matrix *labels);
+
+    // moves the first count samples of the file into data (featureCount x count) and labels (1 x count),
+    // normalized like the batches. they are left out of every later epoch and of getSampleCount()
+    bool holdOut(uint count, Matrix *data, Matrix *labels);
+
+private:
+    struct Shard
+    {
+        uint samples = 0;
+        std::vector<float> features; // features[sample * featureCount + feature]
+        std::vector<float> labels;
+    };
+
+    std::ifstream file;
+    std::string filename;
+    uint featureCount;
+    uint shardSize;
+    uint shuffleWindow;
+    uint sampleCount = 0;
+    std::streampos dataStart = 0; // behind the held out samples
+    uint dataStartLine = 0;
+    Normalization normalization;
+
+    // consumer side
+    std::vector<Shard> window;
+    std::vector<std::pair<uint, uint>> order; // (shard, sample) in shuffled order
+    uint orderPosition = 0;
+    bool endOfFile = false;
+    std::mt19937 rng;
+
+    // reader thread
+    std::thread reader;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<Shard> queue;
+    bool stopReader = false;
+    uint lineNumber = 0; // lines read so far, for the error messages
+    uint shardIndex = 0;
+    bool readError = false; // set before the end of the stream is queued
+
+    void startReader();
+    void stopReaderThread();
+    void readerLoop();
+    bool readShard(Shard *shard);
+    bool fillWindow();
+};
+
+/*
+    dataset held in memory as uint8 (one sample per line, label first, features 0-255),
+    a quarter of the memory of the float matrices of matrixLoad.
+    the file is parsed in one pass into feature-major panels of 256 samples, so assembleBatch reads
+    every feature of a range of samples as contiguous bytes while it converts them to a feature-major
+    float batch, normalizes it and writes the class indices in the same pass.
+*/
+class ByteDataset
+{
+public:
+    ByteDataset(const char *filename, uint featureCount_);
+
+    bool isOpen();
+    uint getSampleCount();
+    uint getFeatureCount();
+    size_t getMemoryUsage();
+
+    // scale, then mean and standard deviation of the scaled features over the whole dataset
+    Normalization standardization(float scale);
+
+    // batch: featureCount x count, labels: 1 x count or nullptr
+    void assembleBatch(uint first, uint count, const Normalization &normalization, Matrix *batch, Matrix *labels_);
+
+private:
+    uint featureCount;
+    uint sampleCount = 0;
+    bool open = false;
+    std::vector<uint8_t, TrackedAllocator<uint8_t>> features; // panels of feature-major samples, the last one may be narrower
+    std::vector<uint8_t, TrackedAllocator<uint8_t>> labels;
+};
+
+#endif
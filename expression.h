@@ -0,0 +1,335 @@
+#ifndef EXPRESSION_H
+#define EXPRESSION_H
+
+#include "matrix.h"
+
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <type_traits>
+
+/*
+    lazy elementwise expressions over Matrix
+
+    an expression such as  weights -= learningRate * gradweights  builds a tree of small value
+    types at compile time, nothing is computed until it is assigned to a matrix. the assignment
+    then runs a single loop over the output and evaluates the whole tree per element, so no
+    temporary matrices are written.
+
+    a * b between two matrices is deliberately not defined (it would read like a matrix product),
+    use hadamard(a, b) for the elementwise product.
+
+        matrixAssign(gradient, hadamard(*tempdZdA, sigmoidDerivative(*activation)));
+        weights -= learningRate * gradweights;
+        matrixAssign(weightedInput, *weightedInput + broadcastRows(bias));
+*/
+
+template <typename E>
+struct MatrixExpression
+{
+    const E &self() const { return static_cast<const E &>(*this); }
+};
+
+/*
+    leaves: every node provides rows, cols (0 = broadcast along that dimension) and
+    operator()(row, index) where index = row * cols + col of the output element
+*/
+
+struct MatrixTerm : MatrixExpression<MatrixTerm>
+{
+    const float *data;
+    uint rows;
+    uint cols;
+
+    explicit MatrixTerm(const Matrix &matrix) : data(matrix.data.data()), rows(matrix.rows), cols(matrix.cols) {}
+    float operator()(uint, size_t index) const { return data[index]; }
+};
+
+struct ScalarTerm : MatrixExpression<ScalarTerm>
+{
+    float value;
+    uint rows = 0;
+    uint cols = 0;
+
+    explicit ScalarTerm(float value_) : value(value_) {}
+    float operator()(uint, size_t) const { return value; }
+};
+
+struct RowBroadcastTerm : MatrixExpression<RowBroadcastTerm>
+{
+    // column vector (rows x 1) repeated over every column, e.g. the bias
+    const float *data;
+    uint rows;
+    uint cols = 0;
+
+    explicit RowBroadcastTerm(const Matrix &vec) : data(vec.data.data()), rows(vec.rows)
+    {
+        assert(vec.cols == 1);
+    }
+    float operator()(uint row, size_t) const { return data[row]; }
+};
+
+inline RowBroadcastTerm broadcastRows(const Matrix &vec)
+{
+    return RowBroadcastTerm(vec);
+}
+
+/*
+    operand mapping: Matrix -> MatrixTerm, arithmetic -> ScalarTerm, expressions -> themselves
+*/
+
+template <typename T, typename = void>
+struct ExpressionOperand
+{
+    static constexpr bool valid = false;
+    static constexpr bool scalar = false;
+};
+
+template <>
+struct ExpressionOperand<Matrix>
+{
+    typedef MatrixTerm type;
+    static constexpr bool valid = true;
+    static constexpr bool scalar = false;
+    static type make(const Matrix &matrix) { return MatrixTerm(matrix); }
+};
+
+template <typename T>
+struct ExpressionOperand<T, typename std::enable_if<std::is_arithmetic<T>::value>::type>
+{
+    typedef ScalarTerm type;
+    static constexpr bool valid = true;
+    static constexpr bool scalar = true;
+    static type make(T value) { return ScalarTerm(static_cast<float>(value)); }
+};
+
+template <typename T>
+struct ExpressionOperand<T, typename std::enable_if<std::is_base_of<MatrixExpression<T>, T>::value>::type>
+{
+    typedef T type;
+    static constexpr bool valid = true;
+    static constexpr bool scalar = false;
+    static const T &make(const T &expression) { return expression; }
+};
+
+template <typename T>
+using ExpressionTerm = typename ExpressionOperand<typename std::decay<T>::type>::type;
+
+template <typename T>
+ExpressionTerm<T> makeTerm(const T &operand)
+{
+    return ExpressionOperand<typename std::decay<T>::type>::make(operand);
+}
+
+template <typename L, typename R>
+struct IsExpressionPair
+{
+    typedef ExpressionOperand<typename std::decay<L>::type> Left;
+    typedef ExpressionOperand<typename std::decay<R>::type> Right;
+    static constexpr bool value = Left::valid && Right::valid && !(Left::scalar && Right::scalar);
+};
+
+template <typename T>
+struct IsExpressionUnary
+{
+    typedef ExpressionOperand<typename std::decay<T>::type> Operand;
+    static constexpr bool value = Operand::valid && !Operand::scalar;
+};
+
+/*
+    inner nodes
+*/
+
+inline uint broadcastDimension(uint left, uint right)
+{
+    assert(left == 0 || right == 0 || left == right);
+    return left != 0 ? left : right;
+}
+
+template <typename Op, typename L, typename R>
+struct BinaryExpression : MatrixExpression<BinaryExpression<Op, L, R>>
+{
+    L left;
+    R right;
+    uint rows;
+    uint cols;
+
+    BinaryExpression(const L &left_, const R &right_) : left(left_), right(right_),
+                                                        rows(broadcastDimension(left_.rows, right_.rows)),
+                                                        cols(broadcastDimension(left_.cols, right_.cols))
+    {
+    }
+
+    float operator()(uint row, size_t index) const { return Op::apply(left(row, index), right(row, index)); }
+};
+
+template <typename Op, typename E>
+struct UnaryExpression : MatrixExpression<UnaryExpression<Op, E>>
+{
+    E operand;
+    uint rows;
+    uint cols;
+
+    explicit UnaryExpression(const E &operand_) : operand(operand_), rows(operand_.rows), cols(operand_.cols) {}
+    float operator()(uint row, size_t index) const { return Op::apply(operand(row, index)); }
+};
+
+struct AddOp
+{
+    static float apply(float a, float b) { return a + b; }
+};
+
+struct SubstractOp
+{
+    static float apply(float a, float b) { return a - b; }
+};
+
+struct MultiplyOp
+{
+    static float apply(float a, float b) { return a * b; }
+};
+
+struct DivideOp
+{
+    static float apply(float a, float b) { return a / b; }
+};
+
+struct NegateOp
+{
+    static float apply(float a) { return -a; }
+};
+
+struct SigmoidOp
+{
+    static float apply(float a) { return 1.0f / (1.0f + std::exp(-a)); }
+};
+
+struct ReLuOp
+{
+    static float apply(float a) { return a >= 0.0f ? a : 0.0f; }
+};
+
+struct SigmoidDerivativeOp
+{
+    // operand is the sigmoid activation
+    static float apply(float a) { return a * (1.0f - a); }
+};
+
+struct ReLuDerivativeOp
+{
+    // operand is the weighted input
+    static float apply(float a) { return a >= 0.0f ? 1.0f : 0.0f; }
+};
+
+/*
+    operators and functions building the tree
+*/
+
+template <typename L, typename R, typename std::enable_if<IsExpressionPair<L, R>::value, int>::type = 0>
+BinaryExpression<AddOp, ExpressionTerm<L>, ExpressionTerm<R>> operator+(const L &left, const R &right)
+{
+    return BinaryExpression<AddOp, ExpressionTerm<L>, ExpressionTerm<R>>(makeTerm(left), makeTerm(right));
+}
+
+template <typename L, typename R, typename std::enable_if<IsExpressionPair<L, R>::value, int>::type = 0>
+BinaryExpression<SubstractOp, ExpressionTerm<L>, ExpressionTerm<R>> operator-(const L &left, const R &right)
+{
+    return BinaryExpression<SubstractOp, ExpressionTerm<L>, ExpressionTerm<R>>(makeTerm(left), makeTerm(right));
+}
+
+// scaling only, see hadamard() for the elementwise product of two matrices
+template <typename L, typename R,
+          typename std::enable_if<IsExpressionPair<L, R>::value &&
+                                      (ExpressionOperand<typename std::decay<L>::type>::scalar || ExpressionOperand<typename std::decay<R>::type>::scalar),
+                                  int>::type = 0>
+BinaryExpression<MultiplyOp, ExpressionTerm<L>, ExpressionTerm<R>> operator*(const L &left, const R &right)
+{
+    return BinaryExpression<MultiplyOp, ExpressionTerm<L>, ExpressionTerm<R>>(makeTerm(left), makeTerm(right));
+}
+
+template <typename L, typename R, typename std::enable_if<IsExpressionPair<L, R>::value, int>::type = 0>
+BinaryExpression<DivideOp, ExpressionTerm<L>, ExpressionTerm<R>> operator/(const L &left, const R &right)
+{
+    return BinaryExpression<DivideOp, ExpressionTerm<L>, ExpressionTerm<R>>(makeTerm(left), makeTerm(right));
+}
+
+template <typename L, typename R, typename std::enable_if<IsExpressionPair<L, R>::value, int>::type = 0>
+BinaryExpression<MultiplyOp, ExpressionTerm<L>, ExpressionTerm<R>> hadamard(const L &left, const R &right)
+{
+    return BinaryExpression<MultiplyOp, ExpressionTerm<L>, ExpressionTerm<R>>(makeTerm(left), makeTerm(right));
+}
+
+template <typename E, typename std::enable_if<IsExpressionUnary<E>::value, int>::type = 0>
+UnaryExpression<NegateOp, ExpressionTerm<E>> operator-(const E &operand)
+{
+    return UnaryExpression<NegateOp, ExpressionTerm<E>>(makeTerm(operand));
+}
+
+template <typename E, typename std::enable_if<IsExpressionUnary<E>::value, int>::type = 0>
+UnaryExpression<SigmoidOp, ExpressionTerm<E>> sigmoid(const E &operand)
+{
+    return UnaryExpression<SigmoidOp, ExpressionTerm<E>>(makeTerm(operand));
+}
+
+template <typename E, typename std::enable_if<IsExpressionUnary<E>::value, int>::type = 0>
+UnaryExpression<ReLuOp, ExpressionTerm<E>> relu(const E &operand)
+{
+    return UnaryExpression<ReLuOp, ExpressionTerm<E>>(makeTerm(operand));
+}
+
+template <typename E, typename std::enable_if<IsExpressionUnary<E>::value, int>::type = 0>
+UnaryExpression<SigmoidDerivativeOp, ExpressionTerm<E>> sigmoidDerivative(const E &activation)
+{
+    return UnaryExpression<SigmoidDerivativeOp, ExpressionTerm<E>>(makeTerm(activation));
+}
+
+template <typename E, typename std::enable_if<IsExpressionUnary<E>::value, int>::type = 0>
+UnaryExpression<ReLuDerivativeOp, ExpressionTerm<E>> reluDerivative(const E &weightedInput)
+{
+    return UnaryExpression<ReLuDerivativeOp, ExpressionTerm<E>>(makeTerm(weightedInput));
+}
+
+/*
+    evaluation: one pass over out, out may appear in the expression (elementwise aliasing is safe)
+*/
+
+template <typename E>
+void matrixAssign(Matrix *out, const MatrixExpression<E> &expression)
+{
+    const E &e = expression.self();
+    assert(e.rows == 0 || e.rows == out->rows);
+    assert(e.cols == 0 || e.cols == out->cols);
+
+    float *data = out->data.data();
+    for (uint i = 0; i < out->rows; i++)
+    {
+        size_t row = static_cast<size_t>(i) * out->cols;
+        for (uint j = 0; j < out->cols; j++)
+        {
+            data[row + j] = e(i, row + j);
+        }
+    }
+}
+
+template <typename E, typename std::enable_if<ExpressionOperand<typename std::decay<E>::type>::valid, int>::type = 0>
+Matrix &operator+=(Matrix &out, const E &operand)
+{
+    matrixAssign(&out, MatrixTerm(out) + operand);
+    return out;
+}
+
+template <typename E, typename std::enable_if<ExpressionOperand<typename std::decay<E>::type>::valid, int>::type = 0>
+Matrix &operator-=(Matrix &out, const E &operand)
+{
+    matrixAssign(&out, MatrixTerm(out) - operand);
+    return out;
+}
+
+template <typename T, typename std::enable_if<std::is_arithmetic<T>::value, int>::type = 0>
+Matrix &operator*=(Matrix &out, T scalar)
+{
+    matrixAssign(&out, MatrixTerm(out) * scalar);
+    return out;
+}
+
+#endif
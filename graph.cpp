@@ -0,0 +1,903 @@
+#include "graph.h"
+#include "expression.h"
+#include "model.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <condition_variable>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <queue>
+
+GraphPlan::~GraphPlan()
+{
+    for (Matrix *buffer : buffers)
+    {
+        delete buffer;
+    }
+}
+
+Graph::Graph(uint seed, uint threads) : rng(seed), pool(threads)
+{
+}
+
+Graph::~Graph()
+{
+    delete trainingPlan;
+    delete predictionPlan;
+
+    for (GraphNode &node : nodes)
+    {
+        delete node.gradweights;
+        delete node.gradbias;
+        delete node.weightsT;
+    }
+}
+
+int Graph::addInput(uint size)
+{
+    assert(trainingPlan == nullptr && predictionPlan == nullptr);
+
+    GraphNode node;
+    node.type = GraphNodeType::INPUT;
+    node.rows = size;
+    node.inputIndex = inputCount++;
+    nodes.push_back(node);
+    return nodes.size() - 1;
+}
+
+int Graph::addDense(int input, Layer *layer)
+{
+    assert(trainingPlan == nullptr && predictionPlan == nullptr);
+    assert(input >= 0 && input < static_cast<int>(nodes.size()) && layer->getWeights()->cols == nodes[input].rows);
+
+    layer->initWeights(rng);
+
+    GraphNode node;
+    node.type = GraphNodeType::DENSE;
+    node.rows = layer->getWeights()->rows;
+    node.inputs = {input};
+    node.layer = layer;
+    nodes.push_back(node);
+
+    int index = nodes.size() - 1;
+    nodes[input].consumers.push_back({index, 0});
+    return index;
+}
+
+int Graph::addAdd(const std::vector<int> &inputs)
+{
+    assert(trainingPlan == nullptr && predictionPlan == nullptr && !inputs.empty());
+
+    GraphNode node;
+    node.type = GraphNodeType::ADD;
+    node.rows = nodes[inputs[0]].rows;
+    node.inputs = inputs;
+    nodes.push_back(node);
+
+    int index = nodes.size() - 1;
+    for (int k = 0; k < static_cast<int>(inputs.size()); k++)
+    {
+        assert(inputs[k] >= 0 && inputs[k] < index && nodes[inputs[k]].rows == nodes[index].rows);
+        nodes[inputs[k]].consumers.push_back({index, k});
+    }
+    return index;
+}
+
+int Graph::addConcat(const std::vector<int> &inputs)
+{
+    assert(trainingPlan == nullptr && predictionPlan == nullptr && !inputs.empty());
+
+    GraphNode node;
+    node.type = GraphNodeType::CONCAT;
+    node.rows = 0;
+    node.inputs = inputs;
+    nodes.push_back(node);
+
+    int index = nodes.size() - 1;
+    for (int k = 0; k < static_cast<int>(inputs.size()); k++)
+    {
+        assert(inputs[k] >= 0 && inputs[k] < index);
+        nodes[index].rows += nodes[inputs[k]].rows;
+        nodes[inputs[k]].consumers.push_back({index, k});
+    }
+    return index;
+}
+
+void Graph::addOutput(int node)
+{
+    assert(node >= 0 && node < static_cast<int>(nodes.size()));
+    assert(nodes[node].type == GraphNodeType::DENSE && nodes[node].layer->getActivationType() == ActivationType::SOFTMAX);
+    assert(nodes[node].outputIndex < 0);
+
+    nodes[node].outputIndex = outputCount++;
+    outputLoss.push_back(0.0f);
+}
+
+GraphNode *Graph::getNode(int index)
+{
+    return &nodes[index];
+}
+
+int Graph::getNodeCount()
+{
+    return nodes.size();
+}
+
+const GraphPlan *Graph::getPlan(bool training)
+{
+    return training ? trainingPlan : predictionPlan;
+}
+
+void Graph::initTraining(uint batchSize)
+{
+    AllocationScope scope("graph");
+
+    for (GraphNode &node : nodes)
+    {
+        if (node.type != GraphNodeType::DENSE)
+            continue;
+
+        Matrix *weights = node.layer->getWeights();
+        node.gradweights = new Matrix(weights->rows, weights->cols);
+        node.gradbias = new Matrix(weights->rows, 1);
+
+        // W^T * dL/dz of one consumer can go straight into the backward kernel of a dense input
+        node.fusedBackward = node.outputIndex < 0 && node.consumers.size() == 1 && nodes[node.consumers[0].first].type == GraphNodeType::DENSE;
+    }
+
+    // the other dense nodes pass W^T * dL/dz back to their input as a separate product
+    for (GraphNode &node : nodes)
+    {
+        if (node.type != GraphNodeType::DENSE)
+            continue;
+
+        GraphNode &input = nodes[node.inputs[0]];
+        if (input.type != GraphNodeType::INPUT && !input.fusedBackward)
+        {
+            node.weightsT = new Matrix(node.layer->getWeights()->cols, node.layer->getWeights()->rows);
+        }
+    }
+
+    delete trainingPlan;
+    trainingPlan = buildPlan(batchSize, true);
+}
+
+GraphPlan *Graph::buildPlan(uint batchSize, bool training)
+{
+    GraphPlan *plan = new GraphPlan();
+    plan->batchSize = batchSize;
+    plan->training = training;
+    plan->nodeValues.resize(nodes.size());
+
+    /*
+        tasks: forward in node order, backward in reverse node order
+    */
+
+    std::vector<int> forwardTask(nodes.size(), -1);
+    std::vector<int> backwardTask(nodes.size(), -1);
+    for (int n = 0; n < static_cast<int>(nodes.size()); n++)
+    {
+        // every sink has to be an output, the consumers of an output would get no gradient
+        assert(nodes[n].type != GraphNodeType::INPUT || !nodes[n].consumers.empty());
+        assert((nodes[n].outputIndex >= 0) == (nodes[n].type != GraphNodeType::INPUT && nodes[n].consumers.empty()));
+
+        if (nodes[n].type != GraphNodeType::INPUT)
+        {
+            forwardTask[n] = plan->tasks.size();
+            plan->tasks.push_back({n, false});
+        }
+    }
+    for (int n = static_cast<int>(nodes.size()) - 1; training && n >= 0; n--)
+    {
+        if (nodes[n].type != GraphNodeType::INPUT)
+        {
+            backwardTask[n] = plan->tasks.size();
+            plan->tasks.push_back({n, true});
+        }
+    }
+
+    std::vector<std::vector<int>> dependencies(plan->tasks.size());
+    for (int n = 0; n < static_cast<int>(nodes.size()); n++)
+    {
+        if (nodes[n].type == GraphNodeType::INPUT)
+            continue;
+
+        for (int input : nodes[n].inputs)
+        {
+            if (nodes[input].type != GraphNodeType::INPUT)
+                dependencies[forwardTask[n]].push_back(forwardTask[input]);
+        }
+        if (training)
+        {
+            dependencies[backwardTask[n]].push_back(forwardTask[n]);
+            for (const std::pair<int, int> &consumer : nodes[n].consumers)
+            {
+                dependencies[backwardTask[n]].push_back(backwardTask[consumer.first]);
+            }
+        }
+    }
+
+    plan->dependents.resize(plan->tasks.size());
+    plan->dependencies.resize(plan->tasks.size());
+    for (int t = 0; t < static_cast<int>(plan->tasks.size()); t++)
+    {
+        std::sort(dependencies[t].begin(), dependencies[t].end());
+        dependencies[t].erase(std::unique(dependencies[t].begin(), dependencies[t].end()), dependencies[t].end());
+        plan->dependencies[t] = dependencies[t].size();
+        for (int d : dependencies[t])
+        {
+            plan->dependents[d].push_back(t);
+        }
+    }
+
+    /*
+        values and the tasks using them
+    */
+
+    auto newValue = [&](uint rows, uint cols, int producer)
+    {
+        GraphValue value;
+        value.rows = rows;
+        value.cols = cols;
+        value.producer = producer;
+        if (producer >= 0)
+            value.users.push_back(producer);
+        plan->values.push_back(value);
+        return static_cast<int>(plan->values.size()) - 1;
+    };
+    auto use = [&](int value, int task)
+    {
+        plan->values[value].users.push_back(task);
+    };
+
+    for (int n = 0; n < static_cast<int>(nodes.size()); n++)
+    {
+        GraphNode &node = nodes[n];
+        GraphNodeValues &values = plan->nodeValues[n];
+        int forward = forwardTask[n];
+        int backward = backwardTask[n];
+
+        if (node.type == GraphNodeType::INPUT)
+        {
+            values.activation = newValue(node.rows, batchSize, -1);
+            plan->values[values.activation].external = true;
+        }
+        else if (node.type == GraphNodeType::DENSE && training)
+        {
+            uint inputRows = nodes[node.inputs[0]].rows;
+            values.weightedInput = newValue(node.rows, batchSize, forward);
+            if (node.outputIndex >= 0)
+            {
+                // forwardOutput yields dL/dz directly, the activation is not formed
+                values.gradient = newValue(node.rows, batchSize, forward);
+                use(values.gradient, backward);
+            }
+            else
+            {
+                values.activation = newValue(node.rows, batchSize, forward);
+                use(values.activation, backward);
+                use(values.weightedInput, backward);
+                values.gradient = newValue(node.rows, batchSize, backward);
+            }
+            values.inputT = newValue(batchSize, inputRows, backward);
+            if (node.weightsT != nullptr)
+            {
+                values.inputGradient = newValue(inputRows, batchSize, backward);
+            }
+        }
+        else if (node.type == GraphNodeType::DENSE)
+        {
+            // predict activates in place
+            values.activation = newValue(node.rows, batchSize, forward);
+            plan->values[values.activation].external = node.outputIndex >= 0;
+        }
+        else
+        {
+            values.activation = newValue(node.rows, batchSize, forward);
+        }
+
+        for (int input : node.inputs)
+        {
+            use(plan->nodeValues[input].activation, forward);
+            if (training && node.type == GraphNodeType::DENSE)
+                use(plan->nodeValues[input].activation, backward);
+        }
+    }
+
+    // dL/da of every node: the contribution of its only consumer, or the sum over its consumers
+    for (int n = static_cast<int>(nodes.size()) - 1; training && n >= 0; n--)
+    {
+        GraphNode &node = nodes[n];
+        GraphNodeValues &values = plan->nodeValues[n];
+        if (node.type == GraphNodeType::INPUT || node.outputIndex >= 0)
+            continue;
+
+        if (node.fusedBackward)
+        {
+            use(plan->nodeValues[node.consumers[0].first].gradient, backwardTask[n]);
+            continue;
+        }
+
+        bool single = node.consumers.size() == 1 && nodes[node.consumers[0].first].type != GraphNodeType::CONCAT;
+        if (!single)
+        {
+            values.outputGradient = newValue(node.rows, batchSize, backwardTask[n]);
+        }
+        for (const std::pair<int, int> &consumer : node.consumers)
+        {
+            GraphNodeValues &consumerValues = plan->nodeValues[consumer.first];
+            int contribution = nodes[consumer.first].type == GraphNodeType::DENSE ? consumerValues.inputGradient : consumerValues.gradientOf;
+            use(contribution, backwardTask[n]);
+            values.gradientOf = single ? contribution : values.outputGradient;
+        }
+    }
+
+    assignBuffers(plan);
+    return plan;
+}
+
+void Graph::assignBuffers(GraphPlan *plan)
+{
+    AllocationScope scope("graph");
+
+    // ancestors of every task, the tasks are in a topological order
+    std::vector<std::vector<bool>> before(plan->tasks.size(), std::vector<bool>(plan->tasks.size(), false));
+    for (int t = 0; t < static_cast<int>(plan->tasks.size()); t++)
+    {
+        for (int dependent : plan->dependents[t])
+        {
+            before[dependent][t] = true;
+            for (int a = 0; a < t; a++)
+            {
+                if (before[t][a])
+                    before[dependent][a] = true;
+            }
+        }
+    }
+
+    std::vector<int> order;
+    for (int v = 0; v < static_cast<int>(plan->values.size()); v++)
+    {
+        if (!plan->values[v].external)
+            order.push_back(v);
+    }
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b)
+                     { return plan->values[a].producer < plan->values[b].producer; });
+
+    // a buffer is free for a value once all users of its last value happen before the producer
+    std::vector<int> lastValue;
+    for (int v : order)
+    {
+        GraphValue &value = plan->values[v];
+        for (int b = 0; b < static_cast<int>(lastValue.size()) && value.buffer < 0; b++)
+        {
+            GraphValue &last = plan->values[lastValue[b]];
+            if (last.rows != value.rows || last.cols != value.cols)
+                continue;
+
+            bool free = std::all_of(last.users.begin(), last.users.end(), [&](int user)
+                                    { return before[value.producer][user]; });
+            if (free)
+            {
+                value.buffer = b;
+                lastValue[b] = v;
+            }
+        }
+        if (value.buffer < 0)
+        {
+            value.buffer = lastValue.size();
+            lastValue.push_back(v);
+        }
+        plan->unplannedBytes += static_cast<size_t>(value.rows) * value.cols * sizeof(float);
+    }
+
+    for (int v : lastValue)
+    {
+        plan->buffers.push_back(new Matrix(plan->values[v].rows, plan->values[v].cols));
+        plan->plannedBytes += plan->buffers.back()->data.size() * sizeof(float);
+    }
+
+    plan->bound.assign(plan->values.size(), nullptr);
+    for (int v = 0; v < static_cast<int>(plan->values.size()); v++)
+    {
+        if (!plan->values[v].external)
+            plan->bound[v] = plan->buffers[plan->values[v].buffer];
+    }
+}
+
+void Graph::forwardBackward(const std::vector<Matrix *> &data, const std::vector<Matrix *> &labels, float *loss)
+{
+    assert(trainingPlan != nullptr && static_cast<int>(data.size()) == inputCount && static_cast<int>(labels.size()) == outputCount);
+
+    for (GraphNode &node : nodes)
+    {
+        if (node.type != GraphNodeType::INPUT)
+            continue;
+
+        Matrix *input = data[node.inputIndex];
+        assert(input->rows == node.rows && input->cols == trainingPlan->batchSize);
+        trainingPlan->bound[trainingPlan->nodeValues[&node - nodes.data()].activation] = input;
+    }
+
+    currentLabels = &labels;
+    run(trainingPlan);
+    currentLabels = nullptr;
+
+    *loss = 0.0f;
+    for (float outputLoss_ : outputLoss)
+    {
+        *loss += outputLoss_;
+    }
+}
+
+void Graph::step(float learningRate)
+{
+    for (GraphNode &node : nodes)
+    {
+        if (node.type == GraphNodeType::DENSE)
+            node.layer->step(learningRate, node.gradweights, node.gradbias);
+    }
+}
+
+void Graph::predict(const std::vector<Matrix *> &data, const std::vector<Matrix *> &predictions)
+{
+    assert(static_cast<int>(data.size()) == inputCount && static_cast<int>(predictions.size()) == outputCount);
+
+    // the layers predict concurrently, their copies for predict are brought up to date before
+    for (GraphNode &node : nodes)
+    {
+        if (node.type == GraphNodeType::DENSE)
+        {
+            node.layer->prepareInference();
+        }
+    }
+
+    uint batchSize = data[0]->cols;
+    if (predictionPlan == nullptr || predictionPlan->batchSize != batchSize)
+    {
+        delete predictionPlan;
+        predictionPlan = buildPlan(batchSize, false);
+    }
+
+    for (int n = 0; n < static_cast<int>(nodes.size()); n++)
+    {
+        int value = predictionPlan->nodeValues[n].activation;
+        if (nodes[n].type == GraphNodeType::INPUT)
+        {
+            predictionPlan->bound[value] = data[nodes[n].inputIndex];
+        }
+        else if (nodes[n].outputIndex >= 0)
+        {
+            predictionPlan->bound[value] = predictions[nodes[n].outputIndex];
+        }
+        else
+        {
+            continue;
+        }
+        assert(predictionPlan->bound[value]->rows == nodes[n].rows && predictionPlan->bound[value]->cols == batchSize);
+    }
+
+    run(predictionPlan);
+}
+
+void Graph::run(GraphPlan *plan)
+{
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::vector<int> pending = plan->dependencies;
+    size_t remaining = plan->tasks.size();
+
+    // lowest task first, which is the forward order and then the backward order
+    std::priority_queue<int, std::vector<int>, std::greater<int>> ready;
+    for (int t = 0; t < static_cast<int>(plan->tasks.size()); t++)
+    {
+        if (pending[t] == 0)
+            ready.push(t);
+    }
+
+    pool.parallelFor(pool.size(), [&](uint)
+                     {
+        while (true)
+        {
+            int task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [&]
+                               { return !ready.empty() || remaining == 0; });
+                if (remaining == 0)
+                    return;
+                task = ready.top();
+                ready.pop();
+            }
+
+            runTask(plan, plan->tasks[task]);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                remaining--;
+                for (int dependent : plan->dependents[task])
+                {
+                    if (--pending[dependent] == 0)
+                        ready.push(dependent);
+                }
+            }
+            condition.notify_all();
+        } });
+}
+
+void Graph::runTask(GraphPlan *plan, const GraphTask &task)
+{
+    GraphNode &node = nodes[task.node];
+    GraphNodeValues &values = plan->nodeValues[task.node];
+    Matrix *activation = values.activation >= 0 ? plan->bound[values.activation] : nullptr;
+    Matrix *in = plan->bound[plan->nodeValues[node.inputs[0]].activation];
+
+    if (!task.backward)
+    {
+        switch (node.type)
+        {
+        case GraphNodeType::DENSE:
+            if (!plan->training)
+            {
+                node.layer->predict(in, activation, activation);
+            }
+            else if (node.outputIndex >= 0)
+            {
+                node.layer->forwardOutput(in, (*currentLabels)[node.outputIndex], plan->bound[values.weightedInput], plan->bound[values.gradient],
+                                          node.gradbias, &outputLoss[node.outputIndex]);
+            }
+            else
+            {
+                node.layer->forward(in, plan->bound[values.weightedInput], activation);
+            }
+            break;
+
+        case GraphNodeType::ADD:
+            if (node.inputs.size() == 1)
+            {
+                *activation = *in;
+            }
+            for (size_t k = 1; k < node.inputs.size(); k++)
+            {
+                matrixAdd(k == 1 ? in : activation, plan->bound[plan->nodeValues[node.inputs[k]].activation], activation);
+            }
+            break;
+
+        case GraphNodeType::CONCAT:
+        {
+            // row-major, the rows of every input are one contiguous block
+            auto position = activation->data.begin();
+            for (int input : node.inputs)
+            {
+                Matrix *part = plan->bound[plan->nodeValues[input].activation];
+                position = std::copy(part->data.begin(), part->data.end(), position);
+            }
+            break;
+        }
+
+        case GraphNodeType::INPUT:
+            break;
+        }
+        return;
+    }
+
+    if (values.outputGradient >= 0)
+    {
+        sumGradient(plan, task.node, plan->bound[values.outputGradient]);
+    }
+    if (node.type != GraphNodeType::DENSE)
+        return;
+
+    Matrix *gradient = plan->bound[values.gradient];
+    if (node.fusedBackward)
+    {
+        GraphNode &consumer = nodes[node.consumers[0].first];
+        node.layer->hiddenGradient(consumer.layer->getWeights(), plan->bound[plan->nodeValues[node.consumers[0].first].gradient],
+                                   plan->bound[values.weightedInput], activation, gradient, node.gradbias);
+    }
+    else if (node.outputIndex < 0)
+    {
+        node.layer->hiddenGradient(plan->bound[values.gradientOf], plan->bound[values.weightedInput], activation, gradient, node.gradbias);
+    }
+
+    Matrix *inputT = plan->bound[values.inputT];
+    matrixTranspose(in, inputT);
+    matrixMultiply(gradient, inputT, node.gradweights);
+    *node.gradweights *= 1.0f / static_cast<float>(gradient->cols);
+
+    if (values.inputGradient >= 0)
+    {
+        matrixTranspose(node.layer->getWeights(), node.weightsT);
+        matrixMultiply(node.weightsT, gradient, plan->bound[values.inputGradient]);
+    }
+}
+
+void Graph::sumGradient(GraphPlan *plan, int node, Matrix *out)
+{
+    bool first = true;
+    for (const std::pair<int, int> &consumer : nodes[node].consumers)
+    {
+        GraphNode &consumerNode = nodes[consumer.first];
+        GraphNodeValues &consumerValues = plan->nodeValues[consumer.first];
+
+        Matrix *source;
+        size_t offset = 0;
+        if (consumerNode.type == GraphNodeType::DENSE)
+        {
+            source = plan->bound[consumerValues.inputGradient];
+        }
+        else
+        {
+            source = plan->bound[consumerValues.gradientOf];
+            for (int k = 0; consumerNode.type == GraphNodeType::CONCAT && k < consumer.second; k++)
+            {
+                offset += static_cast<size_t>(nodes[consumerNode.inputs[k]].rows) * out->cols;
+            }
+        }
+
+        const float *part = source->data.data() + offset;
+        for (size_t i = 0; i < out->data.size(); i++)
+        {
+            out->data[i] = first ? part[i] : out->data[i] + part[i];
+        }
+        first = false;
+    }
+}
+
+void Graph::information()
+{
+    std::cout << "\n";
+    for (int n = 0; n < static_cast<int>(nodes.size()); n++)
+    {
+        GraphNode &node = nodes[n];
+        std::cout << "Node: " << n << " >> ";
+        switch (node.type)
+        {
+        case GraphNodeType::INPUT:
+            std::cout << "Input " << node.inputIndex << " Size: " << node.rows << std::endl;
+            continue;
+
+        case GraphNodeType::DENSE:
+            std::cout << "Dense of " << node.inputs[0] << (node.outputIndex >= 0 ? " (output " + std::to_string(node.outputIndex) + ") " : " ");
+            node.layer->information();
+            continue;
+
+        case GraphNodeType::ADD:
+            std::cout << "Add of";
+            break;
+
+        case GraphNodeType::CONCAT:
+            std::cout << "Concat of";
+            break;
+        }
+        for (int input : node.inputs)
+        {
+            std::cout << " " << input;
+        }
+        std::cout << " Size: " << node.rows << std::endl;
+    }
+
+    for (GraphPlan *plan : {trainingPlan, predictionPlan})
+    {
+        if (plan == nullptr)
+            continue;
+
+        std::cout << (plan->training ? "training" : "predict") << " buffers (batch " << plan->batchSize << "): "
+                  << plan->plannedBytes / 1024 << " KiB in " << plan->buffers.size() << " buffers, "
+                  << plan->unplannedBytes / 1024 << " KiB without reuse" << std::endl;
+    }
+    std::cout << std::endl;
+}
+
+namespace
+{
+    void randomBatch(std::mt19937 &rng, uint classes, Matrix *data, Matrix *labels)
+    {
+        std::uniform_real_distribution<float> value(-1.0f, 1.0f);
+        std::uniform_int_distribution<uint> label(0, classes - 1);
+        for (float &x : data->data)
+        {
+            x = value(rng);
+        }
+        for (float &y : labels->data)
+        {
+            y = static_cast<float>(label(rng));
+        }
+    }
+
+    float maxRelativeError(const Matrix &expected, const Matrix &result)
+    {
+        float error = 0.0f;
+        for (size_t i = 0; i < expected.data.size(); i++)
+        {
+            float scale = std::max(std::fabs(expected.data[i]), 1.0f);
+            error = std::max(error, std::fabs(expected.data[i] - result.data[i]) / scale);
+        }
+        return error;
+    }
+
+    // largest |numeric - analytic| / max(|numeric| + |analytic|, 1e-2) over every parameter of the dense nodes
+    float gradientCheck(Graph *graph, Matrix *data, Matrix *labels)
+    {
+        // central differences of a float loss, the step is a compromise between truncation and rounding
+        const float h = 1e-2f;
+        std::vector<Matrix *> in = {data}, target = {labels};
+        float loss;
+        float error = 0.0f;
+
+        graph->forwardBackward(in, target, &loss);
+        std::vector<Matrix> gradweights, gradbias;
+        for (int n = 0; n < graph->getNodeCount(); n++)
+        {
+            GraphNode *node = graph->getNode(n);
+            if (node->type != GraphNodeType::DENSE)
+                continue;
+            gradweights.push_back(*node->gradweights);
+            gradbias.push_back(*node->gradbias);
+        }
+
+        size_t dense = 0;
+        for (int n = 0; n < graph->getNodeCount(); n++)
+        {
+            GraphNode *node = graph->getNode(n);
+            if (node->type != GraphNodeType::DENSE)
+                continue;
+
+            std::pair<Matrix *, Matrix *> parameters[] = {{node->layer->getWeights(), &gradweights[dense]}, {node->layer->getBias(), &gradbias[dense]}};
+            for (std::pair<Matrix *, Matrix *> &parameter : parameters)
+            {
+                for (size_t i = 0; i < parameter.first->data.size(); i++)
+                {
+                    float saved = parameter.first->data[i];
+                    float plus, minus;
+                    parameter.first->data[i] = saved + h;
+                    graph->forwardBackward(in, target, &plus);
+                    parameter.first->data[i] = saved - h;
+                    graph->forwardBackward(in, target, &minus);
+                    parameter.first->data[i] = saved;
+
+                    float numeric = (plus - minus) / (2.0f * h);
+                    float analytic = parameter.second->data[i];
+                    error = std::max(error, std::fabs(numeric - analytic) / std::max(std::fabs(numeric) + std::fabs(analytic), 1e-2f));
+                }
+            }
+            dense++;
+        }
+        return error;
+    }
+}
+
+bool graphConformance(std::ostream &out)
+{
+    const uint batchSize = 16;
+    const uint threads = 2;
+    std::mt19937 rng(7);
+    bool ok = true;
+
+    auto report = [&](const char *name, const char *measure, float value, bool passed)
+    {
+        out << std::setw(26) << std::left << name << std::right << std::setw(24) << measure << std::setw(13) << value << (passed ? "  ok" : "  FAILED") << std::endl;
+        ok = ok && passed;
+    };
+
+    /*
+        linear chain: the same weights trained as a Model and as a Graph
+    */
+
+    {
+        const std::vector<uint> sizes = {20, 16, 12, 5};
+        const ActivationType activations[] = {ActivationType::SIGMOID, ActivationType::RELU, ActivationType::SOFTMAX};
+        Model model(1);
+        Graph graph(1, threads);
+        std::vector<Layer *> graphLayers;
+
+        int node = graph.addInput(sizes[0]);
+        for (size_t l = 0; l + 1 < sizes.size(); l++)
+        {
+            model.addLayer(new Layer(sizes[l], sizes[l + 1], activations[l]));
+            graphLayers.push_back(new Layer(sizes[l], sizes[l + 1], activations[l]));
+            node = graph.addDense(node, graphLayers.back());
+            graphLayers.back()->setParameters(*model.getLayer(l)->getWeights(), *model.getLayer(l)->getBias());
+        }
+        graph.addOutput(node);
+        model.initTraining(batchSize);
+        graph.initTraining(batchSize);
+
+        Matrix data(sizes[0], batchSize), labels(1, batchSize);
+        float lossError = 0.0f;
+        for (int s = 0; s < 5; s++)
+        {
+            randomBatch(rng, sizes.back(), &data, &labels);
+            float modelLoss, graphLoss;
+            std::vector<Matrix *> in = {&data}, target = {&labels};
+            model.forwardBackward(&data, &labels, &modelLoss);
+            graph.forwardBackward(in, target, &graphLoss);
+            model.step(0.5f);
+            graph.step(0.5f);
+            lossError = std::max(lossError, std::fabs(modelLoss - graphLoss) / std::max(std::fabs(modelLoss), 1.0f));
+        }
+
+        float weightsError = 0.0f;
+        for (size_t l = 0; l < graphLayers.size(); l++)
+        {
+            weightsError = std::max(weightsError, maxRelativeError(*model.getLayer(l)->getWeights(), *graphLayers[l]->getWeights()));
+            weightsError = std::max(weightsError, maxRelativeError(*model.getLayer(l)->getBias(), *graphLayers[l]->getBias()));
+        }
+        report("chain vs Model loss", "max relative error", lossError, lossError <= 1e-5f);
+        report("chain vs Model weights", "max relative error", weightsError, weightsError <= 1e-5f);
+
+        for (Layer *layer : graphLayers)
+        {
+            delete layer;
+        }
+    }
+
+    /*
+        skip connection and concatenation: gradients against finite differences
+    */
+
+    {
+        Graph graph(2, threads);
+        std::vector<Layer *> layers = {new Layer(12, 10, ActivationType::SIGMOID), new Layer(10, 10, ActivationType::SIGMOID),
+                                       new Layer(12, 6, ActivationType::SIGMOID), new Layer(16, 4, ActivationType::SOFTMAX)};
+
+        int input = graph.addInput(12);
+        int a = graph.addDense(input, layers[0]);
+        int b = graph.addDense(a, layers[1]);
+        int skip = graph.addAdd({a, b});
+        int branch = graph.addDense(input, layers[2]);
+        int concat = graph.addConcat({skip, branch});
+        graph.addOutput(graph.addDense(concat, layers[3]));
+        graph.initTraining(batchSize);
+
+        Matrix data(12, batchSize), labels(1, batchSize);
+        randomBatch(rng, 4, &data, &labels);
+        float error = gradientCheck(&graph, &data, &labels);
+        report("skip + concat gradients", "max finite difference", error, error <= 1e-2f);
+
+        for (Layer *layer : layers)
+        {
+            delete layer;
+        }
+    }
+
+    /*
+        buffer plan of a deep chain: the values of finished layers are reused
+    */
+
+    {
+        const uint depth = 12;
+        Graph graph(3, threads);
+        std::vector<Layer *> layers;
+
+        int node = graph.addInput(32);
+        for (uint l = 0; l < depth; l++)
+        {
+            layers.push_back(new Layer(32, l + 1 < depth ? 32 : 10, l + 1 < depth ? ActivationType::RELU : ActivationType::SOFTMAX));
+            node = graph.addDense(node, layers.back());
+        }
+        graph.addOutput(node);
+        graph.initTraining(batchSize);
+
+        Matrix data(32, batchSize), prediction(10, batchSize);
+        graph.predict({&data}, {&prediction});
+
+        // predict only needs the activations of the layer before, training keeps them for the backward
+        const GraphPlan *predictPlan = graph.getPlan(false);
+        const GraphPlan *trainingPlan = graph.getPlan(true);
+        report("deep chain predict plan", "buffers per node", static_cast<float>(predictPlan->buffers.size()) / static_cast<float>(graph.getNodeCount()),
+               predictPlan->buffers.size() < static_cast<size_t>(graph.getNodeCount()));
+        report("deep chain training plan", "planned / unplanned bytes", static_cast<float>(trainingPlan->plannedBytes) / static_cast<float>(trainingPlan->unplannedBytes),
+               trainingPlan->plannedBytes < trainingPlan->unplannedBytes);
+
+        for (Layer *layer : layers)
+        {
+            delete layer;
+        }
+    }
+
+    return ok;
+}
@@ -0,0 +1,150 @@
+#ifndef GRAPH_H
+#define GRAPH_H
+
+#include "layer.h"
+#include "matrix.h"
+#include "threadpool.h"
+
+#include <ostream>
+#include <random>
+#include <vector>
+
+/*
+    model as a directed acyclic graph of nodes that declare their inputs: dense layers, element-wise
+    sums (skip connections) and row-wise concatenations (multi-branch blocks), with any number of
+    inputs and softmax outputs. nodes can only consume nodes added before them, so the node order is
+    topological.
+
+    forward and backward of every node are tasks with explicit dependencies, a scheduler runs every
+    task whose dependencies are done on the ThreadPool, so independent branches run concurrently and
+    the backward of a branch starts as soon as its consumers are done.
+
+    the activations and gradients are planned per batch size: a buffer is reused by a later value
+    once every task using its current value happens before the producer of the later value in every
+    possible schedule, so the memory is bounded by the liveness of the values instead of the node count.
+*/
+
+enum class GraphNodeType
+{
+    INPUT,
+    DENSE,
+    ADD,   // element-wise sum of the inputs
+    CONCAT // inputs stacked along the rows
+};
+
+struct GraphNode
+{
+    GraphNodeType type;
+    uint rows; // features per sample
+    std::vector<int> inputs;
+    std::vector<std::pair<int, int>> consumers; // (node, input slot) of every edge leaving the node
+    Layer *layer = nullptr;
+    int inputIndex = -1;  // position in the data of forwardBackward / predict
+    int outputIndex = -1; // position in the labels / predictions, dense softmax nodes only
+
+    // training
+    Matrix *gradweights = nullptr;
+    Matrix *gradbias = nullptr;
+    Matrix *weightsT = nullptr;
+    bool fusedBackward = false; // hidden dense node feeding only one dense node: dL/da is fused into its backward
+};
+
+struct GraphTask
+{
+    int node;
+    bool backward;
+};
+
+struct GraphValue
+{
+    uint rows;
+    uint cols;
+    int producer;           // task
+    std::vector<int> users; // tasks, including the producer
+    bool external = false;  // data or prediction of the caller
+    int buffer = -1;
+};
+
+// values of one node in a plan, -1 if the node has none
+struct GraphNodeValues
+{
+    int activation = -1;
+    int weightedInput = -1;
+    int gradient = -1;       // dL/dz (dense)
+    int inputGradient = -1;  // dL/da of the input node through this node (dense)
+    int outputGradient = -1; // dL/da summed over the consumers
+    int inputT = -1;         // transposed input for dL/dW (dense)
+    int gradientOf = -1;     // value that holds dL/da of this node, may be a value of a consumer
+};
+
+struct GraphPlan
+{
+    uint batchSize = 0;
+    bool training = false;
+
+    std::vector<GraphTask> tasks; // in a topological order
+    std::vector<std::vector<int>> dependents;
+    std::vector<int> dependencies;
+
+    std::vector<GraphNodeValues> nodeValues;
+    std::vector<GraphValue> values;
+    std::vector<Matrix *> buffers;
+    std::vector<Matrix *> bound; // buffer of every value, external values are bound on every call
+
+    size_t plannedBytes = 0;
+    size_t unplannedBytes = 0; // one buffer per value
+
+    ~GraphPlan();
+};
+
+class Graph
+{
+public:
+    explicit Graph(uint seed, uint threads = 0);
+    ~Graph();
+
+    int addInput(uint size);
+    int addDense(int input, Layer *layer);
+    int addAdd(const std::vector<int> &inputs);
+    int addConcat(const std::vector<int> &inputs);
+    void addOutput(int node); // dense softmax node without consumers, the loss is the sum over the outputs
+
+    void initTraining(uint batchSize);
+
+    // data per input (features x samples), labels per output (1 x samples class indices)
+    void forwardBackward(const std::vector<Matrix *> &data, const std::vector<Matrix *> &labels, float *loss);
+    void step(float learningRate);
+    void predict(const std::vector<Matrix *> &data, const std::vector<Matrix *> &predictions);
+
+    GraphNode *getNode(int index);
+    int getNodeCount();
+    const GraphPlan *getPlan(bool training); // nullptr before initTraining / the first predict
+    void information();
+
+private:
+    std::vector<GraphNode> nodes;
+    int inputCount = 0;
+    int outputCount = 0;
+    std::mt19937 rng;
+    ThreadPool pool;
+
+    GraphPlan *trainingPlan = nullptr;
+    GraphPlan *predictionPlan = nullptr;
+    std::vector<float> outputLoss;
+
+    const std::vector<Matrix *> *currentLabels = nullptr;
+
+    GraphPlan *buildPlan(uint batchSize, bool training);
+    void assignBuffers(GraphPlan *plan);
+    void run(GraphPlan *plan);
+    void runTask(GraphPlan *plan, const GraphTask &task);
+    void sumGradient(GraphPlan *plan, int node, Matrix *out);
+};
+
+// a linear chain has to train like Model::forwardBackward / step, dL/dW and dL/db of a graph with a
+// skip connection and a concatenation have to match central differences of the loss, the predict plan
+// of a deep chain has to need fewer buffers than it has nodes and its training plan less memory than
+// one buffer per value. prints one line per check, false on a mismatch (benchmark --graph-conformance)
+bool graphConformance(std::ostream &out);
+
+#endif
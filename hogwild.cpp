@@ -0,0 +1,241 @@
+#include "hogwild.h"
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <iomanip>
+
+namespace
+{
+    // the shared weights are read and written by all workers at once, element-wise relaxed atomics
+    // keep every access well-defined without ordering or locking anything
+    inline float relaxedLoad(const float *p)
+    {
+        float value;
+        __atomic_load(p, &value, __ATOMIC_RELAXED);
+        return value;
+    }
+
+    inline void relaxedStore(float *p, float value)
+    {
+        __atomic_store(p, &value, __ATOMIC_RELAXED);
+    }
+
+    void snapshot(Matrix *shared, Matrix *replica)
+    {
+        for (size_t i = 0; i < shared->data.size(); i++)
+        {
+            replica->data[i] = relaxedLoad(&shared->data[i]);
+        }
+    }
+
+    // the replica follows the updates of its own worker until the next snapshot
+    void update(Matrix *shared, Matrix *replica, Matrix *gradient, float scale)
+    {
+        for (size_t i = 0; i < shared->data.size(); i++)
+        {
+            float g = gradient->data[i];
+            if (g != 0.0f)
+            {
+                relaxedStore(&shared->data[i], relaxedLoad(&shared->data[i]) - scale * g);
+                replica->data[i] -= scale * g;
+            }
+        }
+    }
+
+    float accuracy(Model *model, Matrix *testData, Matrix *testLabels)
+    {
+        Matrix prediction(model->getLayer(model->getLayerCount() - 1)->getWeights()->rows, testData->cols);
+        Matrix index(1, testData->cols);
+        float result;
+        model->predict(testData, &prediction);
+        matrixArgMax(&prediction, &index);
+        matrixAccuracy(&index, testLabels, &result);
+        return result;
+    }
+}
+
+Hogwild::Hogwild(Model *model_, uint batchSize_, uint threads, uint refreshInterval_) : model(model_), batchSize(batchSize_),
+                                                                                      refreshInterval(refreshInterval_ > 0 ? refreshInterval_ : 1), pool(threads)
+{
+    workers.resize(pool.size());
+    for (HogwildWorker &worker : workers)
+    {
+        for (int l = 0; l < model->getLayerCount(); l++)
+        {
+            Layer *layer = model->getLayer(l);
+            Matrix *weights = layer->getWeights();
+
+            worker.replicas.push_back(new Layer(weights->cols, weights->rows, layer->getActivationType()));
+            worker.weightedInput.emplace_back(weights->rows, batchSize);
+            worker.activation.emplace_back(weights->rows, batchSize);
+            worker.gradient.emplace_back(weights->rows, batchSize);
+            worker.gradweights.emplace_back(weights->rows, weights->cols);
+            worker.gradbias.emplace_back(weights->rows, 1);
+            worker.inputT.emplace_back(batchSize, weights->cols);
+        }
+        worker.batch = Matrix(model->getLayer(0)->getWeights()->cols, batchSize);
+        worker.labels = Matrix(1, batchSize);
+    }
+}
+
+Hogwild::~Hogwild()
+{
+    for (HogwildWorker &worker : workers)
+    {
+        for (Layer *replica : worker.replicas)
+        {
+            delete replica;
+        }
+    }
+}
+
+uint Hogwild::getThreadCount()
+{
+    return workers.size();
+}
+
+float Hogwild::trainEpoch(Matrix *data, Matrix *labels, float learningRate)
+{
+    assert(data->cols == labels->cols && data->rows == workers[0].batch.rows);
+
+    uint batches = data->cols / batchSize;
+    std::atomic<uint> next{0};
+    for (HogwildWorker &worker : workers)
+    {
+        worker.lossSum = 0.0f;
+        worker.batches = 0;
+        worker.sinceRefresh = 0;
+    }
+
+    // no barrier between batches, a worker moves on as soon as its update is written
+    pool.parallelFor(workers.size(), [&](uint w)
+                     {
+                         for (uint b = next.fetch_add(1, std::memory_order_relaxed); b < batches; b = next.fetch_add(1, std::memory_order_relaxed))
+                         {
+                             trainBatch(&workers[w], data, labels, b * batchSize, learningRate);
+                         } });
+
+    float lossSum = 0.0f;
+    for (int l = 0; l < model->getLayerCount(); l++)
+    {
+        model->getLayer(l)->weightsChanged();
+    }
+    for (HogwildWorker &worker : workers)
+    {
+        lossSum += worker.lossSum;
+    }
+    return batches > 0 ? lossSum / static_cast<float>(batches) : 0.0f;
+}
+
+void Hogwild::trainBatch(HogwildWorker *worker, Matrix *data, Matrix *labels, uint first, float learningRate)
+{
+    int layerCount = model->getLayerCount();
+    data->getCols(first, first + batchSize, &worker->batch);
+    labels->getCols(first, first + batchSize, &worker->labels);
+
+    if (worker->sinceRefresh == 0)
+    {
+        for (int l = 0; l < layerCount; l++)
+        {
+            Layer *layer = model->getLayer(l);
+            snapshot(layer->getWeights(), worker->replicas[l]->getWeights());
+            snapshot(layer->getBias(), worker->replicas[l]->getBias());
+        }
+    }
+    worker->sinceRefresh = (worker->sinceRefresh + 1) % refreshInterval;
+
+    /*
+        forward and backward on the replica, same math as Model::forwardBackward
+    */
+
+    float loss;
+    for (int l = 0; l < layerCount; l++)
+    {
+        Matrix *in = l == 0 ? &worker->batch : &worker->activation[l - 1];
+        if (l + 1 == layerCount)
+        {
+            worker->replicas[l]->forwardOutput(in, &worker->labels, &worker->weightedInput[l], &worker->gradient[l], &worker->gradbias[l], &loss);
+        }
+        else
+        {
+            worker->replicas[l]->forward(in, &worker->weightedInput[l], &worker->activation[l]);
+        }
+    }
+
+    for (int l = layerCount - 1; l >= 0; l--)
+    {
+        if (l + 1 < layerCount)
+        {
+            worker->replicas[l]->hiddenGradient(worker->replicas[l + 1]->getWeights(), &worker->gradient[l + 1], &worker->weightedInput[l],
+                                                &worker->activation[l], &worker->gradient[l], &worker->gradbias[l]);
+        }
+
+        Matrix *in = l == 0 ? &worker->batch : &worker->activation[l - 1];
+        matrixTranspose(in, &worker->inputT[l]);
+        matrixMultiply(&worker->gradient[l], &worker->inputT[l], &worker->gradweights[l]);
+    }
+
+    // the mean over the batch is folded into the step of the weights, gradbias already is a mean
+    for (int l = 0; l < layerCount; l++)
+    {
+        Layer *layer = model->getLayer(l);
+        update(layer->getWeights(), worker->replicas[l]->getWeights(), &worker->gradweights[l], learningRate / static_cast<float>(batchSize));
+        update(layer->getBias(), worker->replicas[l]->getBias(), &worker->gradbias[l], learningRate);
+    }
+
+    worker->lossSum += loss;
+    worker->batches++;
+}
+
+HogwildReport hogwildCompare(Model *serial, Model *hogwild, Matrix *data, Matrix *labels, Matrix *testData, Matrix *testLabels,
+                             uint batchSize, float learningRate, int epochs, uint threads)
+{
+    HogwildReport report;
+    uint batches = data->cols / batchSize;
+
+    serial->initTraining(batchSize);
+    Matrix batch(data->rows, batchSize);
+    Matrix batchLabels(1, batchSize);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int e = 0; e < epochs; e++)
+    {
+        float lossSum = 0.0f;
+        for (uint b = 0; b < batches; b++)
+        {
+            float loss;
+            data->getCols(b * batchSize, (b + 1) * batchSize, &batch);
+            labels->getCols(b * batchSize, (b + 1) * batchSize, &batchLabels);
+            serial->forwardBackward(&batch, &batchLabels, &loss);
+            serial->step(learningRate);
+            lossSum += loss;
+        }
+        report.serialLoss.push_back(lossSum / static_cast<float>(batches));
+    }
+    report.serialSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    report.serialAccuracy = accuracy(serial, testData, testLabels);
+
+    Hogwild asynchronous(hogwild, batchSize, threads);
+    report.threads = asynchronous.getThreadCount();
+
+    start = std::chrono::steady_clock::now();
+    for (int e = 0; e < epochs; e++)
+    {
+        report.hogwildLoss.push_back(asynchronous.trainEpoch(data, labels, learningRate));
+    }
+    report.hogwildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    report.hogwildAccuracy = accuracy(hogwild, testData, testLabels);
+
+    return report;
+}
+
+void HogwildReport::print(std::ostream &out)
+{
+    out << "epoch  serial loss  hogwild loss (" << threads << " threads)" << std::endl;
+    for (size_t e = 0; e < serialLoss.size(); e++)
+    {
+        out << std::setw(5) << e << std::setw(13) << serialLoss[e] << std::setw(14) << hogwildLoss[e] << std::endl;
+    }
+    out << "accuracy: serial " << serialAccuracy << ", hogwild " << hogwildAccuracy << std::endl;
+    out << "time: serial " << serialSeconds << " s, hogwild " << hogwildSeconds << " s (" << serialSeconds / hogwildSeconds << "x)" << std::endl;
+}
@@ -0,0 +1,82 @@
+#ifndef HOGWILD_H
+#define HOGWILD_H
+
+#include "layer.h"
+#include "matrix.h"
+#include "model.h"
+#include "threadpool.h"
+
+#include <ostream>
+#include <vector>
+
+/*
+    asynchronous lock-free sgd (hogwild): every worker thread takes the next mini-batch of the epoch,
+    runs forward / backward on its own replica of the layers and subtracts its gradient from the shared
+    weights without any lock or barrier.
+
+    the replica is copied from the shared weights only every refreshInterval batches (and at the start
+    of an epoch), in between the worker applies its own updates to the replica as well. the forward pass
+    does not read the shared weights in place: the gemm would read them with plain loads while other
+    workers write them. the copy is O(weights) against O(weights * batchSize) for forward / backward,
+    a refreshInterval of 1 gives the staleness of one batch per worker.
+
+    shared weights are only accessed with relaxed atomic loads and stores per element, concurrent
+    updates of the same weight can overwrite each other (the staleness hogwild tolerates), zero
+    gradients (inputs that are zero in the whole batch) are not written at all. the pruning mask of
+    a layer is not applied to the updates.
+*/
+
+struct HogwildWorker
+{
+    std::vector<Layer *> replicas;
+    std::vector<Matrix> weightedInput;
+    std::vector<Matrix> activation;
+    std::vector<Matrix> gradient;
+    std::vector<Matrix> gradweights;
+    std::vector<Matrix> gradbias;
+    std::vector<Matrix> inputT;
+    Matrix batch;
+    Matrix labels;
+    float lossSum = 0.0f;
+    uint batches = 0;
+    uint sinceRefresh = 0;
+};
+
+class Hogwild
+{
+public:
+    Hogwild(Model *model_, uint batchSize_, uint threads = 0, uint refreshInterval_ = 8);
+    ~Hogwild();
+
+    // one pass over data (features x samples), labels 1 x samples class indices; returns the mean loss
+    float trainEpoch(Matrix *data, Matrix *labels, float learningRate);
+    uint getThreadCount();
+
+private:
+    Model *model;
+    uint batchSize;
+    uint refreshInterval;
+    ThreadPool pool;
+    std::vector<HogwildWorker> workers;
+
+    void trainBatch(HogwildWorker *worker, Matrix *data, Matrix *labels, uint first, float learningRate);
+};
+
+// serial Model::forwardBackward / step against Hogwild on two models with identical weights
+struct HogwildReport
+{
+    uint threads = 0;
+    std::vector<float> serialLoss; // mean loss per epoch
+    std::vector<float> hogwildLoss;
+    double serialSeconds = 0.0;
+    double hogwildSeconds = 0.0;
+    float serialAccuracy = 0.0f;
+    float hogwildAccuracy = 0.0f;
+
+    void print(std::ostream &out);
+};
+
+HogwildReport hogwildCompare(Model *serial, Model *hogwild, Matrix *data, Matrix *labels, Matrix *testData, Matrix *testLabels,
+                             uint batchSize, float learningRate, int epochs, uint threads = 0);
+
+#endif
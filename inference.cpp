@@ -0,0 +1,207 @@
+#include "inference.h"
+#include "checkpoint.h"
+#include "matrix.h"
+#include "model.h"
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+struct MlModel
+{
+    std::vector<LayerSnapshot> layers;
+    std::vector<PackedMatrix> packed; // weights of every layer for batches up to packedMaxCols
+};
+
+struct MlContext
+{
+    MlModel *model; // only read, the matrix functions take non-const pointers
+    uint maxBatch;
+    Matrix input;                    // features x maxBatch
+    std::vector<Matrix> activations; // per layer, outputs x maxBatch
+};
+
+namespace
+{
+    // the workspace is allocated for maxBatch columns, narrower chunks reuse the same storage
+    void setColumns(Matrix *workspace, uint cols)
+    {
+        assert(static_cast<size_t>(workspace->rows) * cols <= workspace->data.capacity());
+        workspace->cols = cols;
+        workspace->data.resize(static_cast<size_t>(workspace->rows) * cols);
+    }
+
+    void predictChunk(MlContext *context, const float *input, size_t inputSampleStride, size_t inputFeatureStride,
+                      float *output, size_t outputSampleStride, size_t outputStride, uint count)
+    {
+        MlModel *model = context->model;
+        Matrix *in = &context->input;
+        setColumns(in, count);
+
+        // the caller's samples into the feature-major layout of the kernels, in 32 x 32 tiles like
+        // matrixTranspose so neither side is walked with a cache miss per element
+        const uint tile = 32;
+        for (uint f0 = 0; f0 < in->rows; f0 += tile)
+        {
+            uint f1 = std::min(f0 + tile, in->rows);
+            for (uint s0 = 0; s0 < count; s0 += tile)
+            {
+                uint s1 = std::min(s0 + tile, count);
+                for (uint f = f0; f < f1; f++)
+                {
+                    float *row = &in->data[static_cast<size_t>(f) * count];
+                    for (uint s = s0; s < s1; s++)
+                    {
+                        row[s] = input[s * inputSampleStride + f * inputFeatureStride];
+                    }
+                }
+            }
+        }
+
+        for (size_t l = 0; l < model->layers.size(); l++)
+        {
+            LayerSnapshot &layer = model->layers[l];
+            Matrix *out = &context->activations[l];
+            setColumns(out, count);
+
+            // single-threaded and without strassen: the shared gemm pool serves one caller at a time
+            // (concurrent contexts would run serially anyway) and strassen allocates per call
+            if (count <= packedMaxCols)
+            {
+                matrixMultiplyPacked(&model->packed[l], in, out);
+            }
+            else
+            {
+                GemmConfig config = matrixDefaultGemmConfig(layer.weights.rows, layer.weights.cols, count);
+                config.threads = 1;
+                config.strassenCutoff = 0;
+                matrixMultiplyConfig(&layer.weights, in, out, config);
+            }
+            matrixVectorAdd(out, &layer.bias, out);
+
+            switch (layer.activationType)
+            {
+            case ActivationType::SIGMOID:
+                matrixSigmoid(out, out);
+                break;
+
+            case ActivationType::RELU:
+                matrixReLu(out, out);
+                break;
+
+            case ActivationType::SOFTMAX:
+                matrixSoftMax(out, out);
+                break;
+            }
+            in = out;
+        }
+
+        for (uint o = 0; o < in->rows; o++)
+        {
+            const float *row = &in->data[static_cast<size_t>(o) * count];
+            for (uint s = 0; s < count; s++)
+            {
+                output[s * outputSampleStride + o * outputStride] = row[s];
+            }
+        }
+    }
+}
+
+MlModel *mlModelLoad(const char *checkpointFile)
+{
+    Checkpoint checkpoint;
+    if (checkpointFile == nullptr || !checkpointRead(checkpointFile, &checkpoint))
+    {
+        std::cerr << "Error: Could not load a model from " << (checkpointFile != nullptr ? checkpointFile : "(null)") << std::endl;
+        return nullptr;
+    }
+    if (checkpoint.model.layers.empty())
+    {
+        std::cerr << "Error: " << checkpointFile << " holds no layers" << std::endl;
+        return nullptr;
+    }
+
+    // predict sizes its buffers from these shapes, a file of another model must not get that far
+    std::vector<LayerSnapshot> &layers = checkpoint.model.layers;
+    for (size_t l = 0; l < layers.size(); l++)
+    {
+        Matrix &weights = layers[l].weights;
+        Matrix &bias = layers[l].bias;
+        uint inputs = l == 0 ? weights.cols : layers[l - 1].weights.rows;
+        if (weights.rows == 0 || weights.cols == 0 || weights.cols != inputs || bias.rows != weights.rows || bias.cols != 1)
+        {
+            std::cerr << "Error: layer " << l << " of " << checkpointFile << " has weights " << weights.shape() << " and bias "
+                      << bias.shape() << ", which do not follow the previous layer" << std::endl;
+            return nullptr;
+        }
+        if (layers[l].activationType > ActivationType::SOFTMAX)
+        {
+            std::cerr << "Error: layer " << l << " of " << checkpointFile << " has an unknown activation" << std::endl;
+            return nullptr;
+        }
+    }
+
+    MlModel *model = new MlModel;
+    model->layers = std::move(checkpoint.model.layers);
+    model->packed.resize(model->layers.size());
+    for (size_t l = 0; l < model->layers.size(); l++)
+    {
+        matrixPack(&model->layers[l].weights, &model->packed[l]);
+    }
+    return model;
+}
+
+void mlModelFree(MlModel *model)
+{
+    delete model;
+}
+
+size_t mlModelInputSize(const MlModel *model)
+{
+    return model->layers.front().weights.cols;
+}
+
+size_t mlModelOutputSize(const MlModel *model)
+{
+    return model->layers.back().weights.rows;
+}
+
+MlContext *mlContextCreate(const MlModel *model, size_t maxBatch)
+{
+    if (model == nullptr || maxBatch == 0 || maxBatch > UINT32_MAX)
+        return nullptr;
+
+    MlContext *context = new MlContext;
+    context->model = const_cast<MlModel *>(model);
+    context->maxBatch = static_cast<uint>(maxBatch);
+    context->input = Matrix(model->layers.front().weights.cols, context->maxBatch);
+    for (const LayerSnapshot &layer : model->layers)
+    {
+        context->activations.push_back(Matrix(layer.weights.rows, context->maxBatch));
+    }
+    return context;
+}
+
+void mlContextFree(MlContext *context)
+{
+    delete context;
+}
+
+int mlPredict(MlContext *context, size_t count,
+              const float *input, size_t inputSampleStride, size_t inputFeatureStride,
+              float *output, size_t outputSampleStride, size_t outputStride)
+{
+    if (context == nullptr || (count > 0 && (input == nullptr || output == nullptr)))
+        return -1;
+    if (inputSampleStride == 0 || inputFeatureStride == 0 || outputSampleStride == 0 || outputStride == 0)
+        return -1;
+
+    for (size_t first = 0; first < count; first += context->maxBatch)
+    {
+        uint chunk = static_cast<uint>(std::min<size_t>(context->maxBatch, count - first));
+        predictChunk(context, input + first * inputSampleStride, inputSampleStride, inputFeatureStride,
+                     output + first * outputSampleStride, outputSampleStride, outputStride, chunk);
+    }
+    return 0;
+}
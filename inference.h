@@ -0,0 +1,54 @@
+#ifndef INFERENCE_H
+#define INFERENCE_H
+
+#include <stddef.h>
+
+/*
+    C interface of the libmlinference shared library, for embedding predict into other processes.
+
+    a model is loaded from a checkpoint file (checkpoint.h, written by Checkpointer) and is read-only
+    afterwards. a context holds the workspace of predict for up to maxBatch samples, all of it
+    allocated by mlContextCreate: mlPredict reads the caller's input and writes the caller's output
+    through explicit strides (in floats), allocates nothing and takes no locks. larger calls are
+    processed maxBatch samples at a time.
+
+    thread safety: a model may be shared by any number of contexts on any threads. a context must
+    only be used by one thread at a time; use one context per thread for concurrent predicts, each
+    call runs on the calling thread only. free the contexts of a model before the model.
+*/
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#if defined(__GNUC__)
+#define ML_API __attribute__((visibility("default")))
+#else
+#define ML_API
+#endif
+
+    typedef struct MlModel MlModel;
+    typedef struct MlContext MlContext;
+
+    // NULL if the file cannot be read or its layer shapes do not form a chain
+    ML_API MlModel *mlModelLoad(const char *checkpointFile);
+    ML_API void mlModelFree(MlModel *model);
+    ML_API size_t mlModelInputSize(const MlModel *model);
+    ML_API size_t mlModelOutputSize(const MlModel *model);
+
+    ML_API MlContext *mlContextCreate(const MlModel *model, size_t maxBatch);
+    ML_API void mlContextFree(MlContext *context);
+
+    // feature f of sample s is input[s * inputSampleStride + f * inputFeatureStride], output o of
+    // sample s goes to output[s * outputSampleStride + o * outputStride]. 0 on success, -1 on
+    // invalid arguments (also any stride of 0)
+    ML_API int mlPredict(MlContext *context, size_t count,
+                         const float *input, size_t inputSampleStride, size_t inputFeatureStride,
+                         float *output, size_t outputSampleStride, size_t outputStride);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
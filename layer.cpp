@@ -1,4 +1,6 @@
 #include "layer.h"
+#include "expression.h"
+#include <algorithm>
 #include <random>
 #include <cassert>
 #include <iostream>
@@ -21,11 +23,8 @@ void Layer::setSubsequentLayer(Layer *layer_)
     subsequentLayer = layer_;
 }
 
-void Layer::initWeights()
+void Layer::initWeights(std::mt19937 &rng)
 {
-    std::random_device dev;
-    std::mt19937 rng(dev());
-
     float stdev = std::sqrt(1.0f / static_cast<float>(weights.cols));
     std::normal_distribution<float> dist(0.0f, stdev);
 
@@ -39,7 +38,7 @@ void Layer::initWeights()
                 random = dist(rng);
             } while (std::abs(random) > 2.0f * stdev);
 
-            weights.data[i * weights.cols + j] = random;
+            weights.data[static_cast<size_t>(i) * weights.cols + j] = random;
         }
     }
 
@@ -53,6 +52,7 @@ void Layer::initWeights()
 
         bias.data[i] = random;
     }
+    weightsChanged();
 }
 
 void Layer::setInput(Matrix *input_)
@@ -60,9 +60,113 @@ void Layer::setInput(Matrix *input_)
     input = input_;
 }
 
-void Layer::setGroundtruth(Matrix *groundtruth_)
+void Layer::setParameters(const Matrix &weights_, const Matrix &bias_)
+{
+    assert(weights_.rows == weights.rows && weights_.cols == weights.cols && bias_.rows == bias.rows);
+    weights = weights_;
+    bias = bias_;
+    weightsChanged();
+}
+
+void Layer::weightsChanged()
+{
+    // built here rather than on demand, so predict only reads the layer and may run concurrently
+    matrixPack(&weights, &packedWeights);
+    if (!mask.data.empty())
+    {
+        matrixToSparse(&weights, &sparseWeights);
+    }
+    inferenceStale = false;
+}
+
+void Layer::prepareInference()
+{
+    if (inferenceStale)
+    {
+        weightsChanged();
+    }
+}
+
+void Layer::prune(float sparsity, uint blockRows, uint blockCols)
+{
+    assert(sparsity >= 0.0f && sparsity <= 1.0f && blockRows > 0 && blockCols > 0);
+
+    uint gridRows = (weights.rows + blockRows - 1) / blockRows;
+    uint gridCols = (weights.cols + blockCols - 1) / blockCols;
+
+    // mean magnitude of every block, edge blocks may be smaller
+    std::vector<float> score(static_cast<size_t>(gridRows) * gridCols, 0.0f);
+    for (uint i = 0; i < weights.rows; i++)
+    {
+        for (uint j = 0; j < weights.cols; j++)
+        {
+            score[static_cast<size_t>(i / blockRows) * gridCols + j / blockCols] += std::abs(weights.data[static_cast<size_t>(i) * weights.cols + j]);
+        }
+    }
+    for (uint bi = 0; bi < gridRows; bi++)
+    {
+        for (uint bj = 0; bj < gridCols; bj++)
+        {
+            size_t size = static_cast<size_t>(std::min((bi + 1) * blockRows, weights.rows) - bi * blockRows) * (std::min((bj + 1) * blockCols, weights.cols) - bj * blockCols);
+            score[static_cast<size_t>(bi) * gridCols + bj] /= static_cast<float>(size);
+        }
+    }
+
+    std::vector<size_t> order(score.size());
+    for (size_t b = 0; b < order.size(); b++)
+    {
+        order[b] = b;
+    }
+    size_t prunedBlocks = static_cast<size_t>(sparsity * static_cast<float>(order.size()));
+    std::nth_element(order.begin(), order.begin() + prunedBlocks, order.end(), [&](size_t a, size_t b)
+                     { return score[a] < score[b]; });
+
+    std::vector<bool> keep(score.size(), true);
+    for (size_t b = 0; b < prunedBlocks; b++)
+    {
+        keep[order[b]] = false;
+    }
+
+    mask = Matrix(weights.rows, weights.cols);
+    for (uint i = 0; i < weights.rows; i++)
+    {
+        for (uint j = 0; j < weights.cols; j++)
+        {
+            mask.data[static_cast<size_t>(i) * weights.cols + j] = keep[static_cast<size_t>(i / blockRows) * gridCols + j / blockCols] ? 1.0f : 0.0f;
+        }
+    }
+
+    matrixHadamard(&weights, &mask, &weights);
+    weightsChanged();
+}
+
+float Layer::getSparsity()
 {
-    groundtruth = groundtruth_;
+    size_t zeros = std::count(weights.data.begin(), weights.data.end(), 0.0f);
+    return static_cast<float>(zeros) / static_cast<float>(weights.data.size());
+}
+
+SparseMatrix *Layer::getSparseWeights()
+{
+    prepareInference();
+    return &sparseWeights;
+}
+
+PackedMatrix *Layer::getPackedWeights()
+{
+    prepareInference();
+    return &packedWeights;
+}
+
+void Layer::setInputProduct(Matrix *product_)
+{
+    assert(product_ == nullptr || (product_->rows == weights.rows));
+    inputProduct = product_;
+}
+
+void Layer::setExternalWeightGradient(bool external_)
+{
+    externalWeightGradient = external_;
 }
 
 Matrix *Layer::getPredictionActivation()
@@ -80,6 +184,21 @@ Matrix *Layer::getWeights()
     return &weights;
 }
 
+Matrix *Layer::getBias()
+{
+    return &bias;
+}
+
+Matrix *Layer::getGradWeights()
+{
+    return gradweights;
+}
+
+Matrix *Layer::getGradBias()
+{
+    return gradbias;
+}
+
 Matrix *Layer::getGradient()
 {
     return gradient;
@@ -103,9 +222,6 @@ void Layer::allocateMatricesTraining(uint batchSize)
     if (subsequentLayer != nullptr)
     {
         assert(subsequentLayer->weights.cols == weights.rows);
-
-        tempSsWeightsT = new Matrix(subsequentLayer->weights.cols, subsequentLayer->weights.rows);
-        tempdZdA = new Matrix(weights.rows, batchSize);
     }
     tempPrActivationT = new Matrix(batchSize, weights.cols);
 }
@@ -126,8 +242,6 @@ void Layer::freeMatricesTraining()
     delete gradweights;
     delete gradbias;
 
-    delete tempSsWeightsT;
-    delete tempdZdA;
     delete tempPrActivationT;
 }
 
@@ -144,61 +258,169 @@ ActivationType Layer::getActivationType()
 
 void Layer::forward()
 {
-    if (previousLayer == nullptr)
+    if (inputProduct != nullptr)
+    {
+        *weightedInput = *inputProduct;
+        activate(weightedInput, activation);
+    }
+    else if (previousLayer == nullptr)
     {
         assert(input != nullptr);
-        matrixMultiply(&weights, input, weightedInput);
+        forward(input, weightedInput, activation);
     }
     else
     {
-        matrixMultiply(&weights, previousLayer->activation, weightedInput);
+        forward(previousLayer->activation, weightedInput, activation);
     }
+}
 
-    matrixVectorAdd(weightedInput, &bias, weightedInput);
+void Layer::forwardOutput(Matrix *labels, float *loss)
+{
+    if (inputProduct != nullptr)
+    {
+        *weightedInput = *inputProduct;
+        matrixVectorAdd(weightedInput, &bias, weightedInput);
+        output(weightedInput, labels, gradient, gradbias, loss);
+    }
+    else if (previousLayer == nullptr)
+    {
+        assert(input != nullptr);
+        forwardOutput(input, labels, weightedInput, gradient, gradbias, loss);
+    }
+    else
+    {
+        forwardOutput(previousLayer->activation, labels, weightedInput, gradient, gradbias, loss);
+    }
+}
+
+void Layer::predict()
+{
+    Matrix *in = previousLayer == nullptr ? input : previousLayer->predictActivation;
+    assert(in != nullptr);
+    predict(in, predictionWeightedInput, predictActivation);
+}
+
+void Layer::predict(Matrix *in, Matrix *weightedInput_, Matrix *activation_)
+{
+    assert(!inferenceStale);
+    if (predictUsesSparse())
+    {
+        matrixSparseMultiply(&sparseWeights, in, weightedInput_);
+        activate(weightedInput_, activation_);
+    }
+    else if (in->cols <= packedMaxCols)
+    {
+        // single samples and small batches: the blocked gemm gets no reuse out of so few columns
+        matrixMultiplyPacked(&packedWeights, in, weightedInput_);
+        activate(weightedInput_, activation_);
+    }
+    else
+    {
+        forward(in, weightedInput_, activation_);
+    }
+}
+
+bool Layer::predictUsesSparse()
+{
+    assert(!inferenceStale);
+    // measured break-even of the csr kernel against the dense gemm is around half of the weights
+    const float sparseDensity = 0.5f;
+    return !mask.data.empty() && sparseWeights.values.size() < sparseDensity * weights.data.size();
+}
+
+bool Layer::predictUsesGemm(uint cols)
+{
+    return !predictUsesSparse() && cols > packedMaxCols;
+}
+
+void Layer::forward(Matrix *in, Matrix *weightedInput_, Matrix *activation_)
+{
+    matrixMultiply(&weights, in, weightedInput_);
+    activate(weightedInput_, activation_);
+}
+
+void Layer::activate(Matrix *weightedInput_, Matrix *activation_)
+{
+    // weightedInput_ holds weights * input, adds the bias and applies the activation
+    matrixVectorAdd(weightedInput_, &bias, weightedInput_);
 
     switch (activationType)
     {
     case ActivationType::SIGMOID:
-        matrixSigmoid(weightedInput, activation);
+        matrixSigmoid(weightedInput_, activation_);
         break;
 
     case ActivationType::RELU:
-        matrixReLu(weightedInput, activation);
+        matrixReLu(weightedInput_, activation_);
         break;
 
     case ActivationType::SOFTMAX:
-        matrixSoftMax(weightedInput, activation);
+        matrixSoftMax(weightedInput_, activation_);
         break;
     }
 }
 
-void Layer::predict()
+void Layer::forwardOutput(Matrix *in, Matrix *labels, Matrix *weightedInput_, Matrix *gradient_, Matrix *gradbias_, float *loss)
 {
-    if (previousLayer == nullptr)
+    matrixMultiply(&weights, in, weightedInput_);
+    matrixVectorAdd(weightedInput_, &bias, weightedInput_);
+    output(weightedInput_, labels, gradient_, gradbias_, loss);
+}
+
+void Layer::output(Matrix *weightedInput_, Matrix *labels, Matrix *gradient_, Matrix *gradbias_, float *loss)
+{
+    // the activation of the output layer is not formed during training, everything comes from the logits
+    switch (activationType)
     {
-        assert(input != nullptr);
-        matrixMultiply(&weights, input, predictionWeightedInput);
+    case ActivationType::SIGMOID:
+        matrixSigmoidLogLoss(weightedInput_, labels, gradient_, gradbias_, loss);
+        break;
+
+    case ActivationType::RELU:
+        matrixReLuMSE(weightedInput_, labels, gradient_, gradbias_, loss);
+        break;
+
+    case ActivationType::SOFTMAX:
+        matrixSoftMaxCrossEntropy(weightedInput_, labels, gradient_, gradbias_, loss);
+        break;
+    default:
+        std::cout << "wrong activationtype in layer detected" << std::endl;
     }
-    else
+}
+
+void Layer::hiddenGradient(Matrix *dA, Matrix *weightedInput_, Matrix *activation_, Matrix *gradient_, Matrix *gradbias_)
+{
+    // dL/dz = dL/da * da/dz and dL/db in one pass
+    switch (activationType)
     {
-        matrixMultiply(&weights, previousLayer->predictActivation, predictionWeightedInput);
-    }
+    case ActivationType::SIGMOID:
+        matrixSigmoidBackward(dA, activation_, gradient_, gradbias_);
+        break;
 
-    matrixVectorAdd(predictionWeightedInput, &bias, predictionWeightedInput);
+    case ActivationType::RELU:
+        matrixReLuBackward(dA, weightedInput_, gradient_, gradbias_);
+        break;
 
+    default:
+        std::cout << "wrong activationtype in layer detected" << std::endl;
+    }
+}
+
+void Layer::hiddenGradient(Matrix *weightsNext, Matrix *gradientNext, Matrix *weightedInput_, Matrix *activation_, Matrix *gradient_, Matrix *gradbias_)
+{
+    // dL/da = weightsNext^T * dL/dz_next is fused into the same pass
     switch (activationType)
     {
     case ActivationType::SIGMOID:
-        matrixSigmoid(predictionWeightedInput, predictActivation);
+        matrixSigmoidBackwardGemm(weightsNext, gradientNext, activation_, gradient_, gradbias_);
         break;
 
     case ActivationType::RELU:
-        matrixReLu(predictionWeightedInput, predictActivation);
+        matrixReLuBackwardGemm(weightsNext, gradientNext, weightedInput_, gradient_, gradbias_);
         break;
 
-    case ActivationType::SOFTMAX:
-        matrixSoftMax(predictionWeightedInput, predictActivation);
-        break;
+    default:
+        std::cout << "wrong activationtype in layer detected" << std::endl;
     }
 }
 
@@ -208,59 +430,19 @@ void Layer::calculateGradients()
         calculate gradient dL/dz
     */
 
-    // layer is output layer
-    if (subsequentLayer == nullptr)
+    // the output layer already has dL/dz and gradbias from forwardOutput
+    if (subsequentLayer != nullptr) // layer is hidden layer, also yields gradbias
     {
-        assert(groundtruth != nullptr);
-        switch (activationType)
-        {
-        case ActivationType::SIGMOID:
-            std::cout << "not supported yet!" << std::endl;
-            // TODO: add LogLossDerivative
-            break;
-
-        case ActivationType::RELU:
-            std::cout << "not supported yet!" << std::endl;
-            // TODO: add MSEDerivative
-            break;
-
-        case ActivationType::SOFTMAX:
-            matrixSoftMaxCCECombinedDerivative(activation, groundtruth, gradient);
-            break;
-        default:
-            std::cout << "wrong activationtype in layer detected" << std::endl;
-        }
-    }
-    else // layer is hidden layer
-    {
-
-        matrixTranspose(subsequentLayer->getWeights(), tempSsWeightsT);
-        matrixMultiply(tempSsWeightsT, subsequentLayer->getGradient(), tempdZdA);
-
-        switch (activationType)
-        {
-        case ActivationType::SIGMOID:
-            matrixSigmoidDerivative(activation, gradient);
-            break;
-
-        case ActivationType::RELU:
-            matrixReLuDerivative(weightedInput, gradient);
-            break;
-
-        default:
-            std::cout << "wrong activationtype in layer detected" << std::endl;
-        }
-        matrixHadamard(tempdZdA, gradient, gradient);
+        hiddenGradient(subsequentLayer->getWeights(), subsequentLayer->getGradient(), weightedInput, activation, gradient, gradbias);
     }
 
     /*
-        calculate gradweights dL/dW and gradbias dL/db
+        calculate gradweights dL/dW
     */
 
-    // bias
-    matrixRowMean(gradient, gradbias);
+    if (externalWeightGradient)
+        return;
 
-    // weights
     if (previousLayer != nullptr) // hidden layer
     {
         matrixTranspose(previousLayer->getActivation(), tempPrActivationT);
@@ -271,17 +453,28 @@ void Layer::calculateGradients()
     }
 
     matrixMultiply(gradient, tempPrActivationT, gradweights);
-    float scalar = 1.0f / static_cast<float>(gradient->cols);
-    matrixScalarMultiply(gradweights, scalar, gradweights);
+    *gradweights *= 1.0f / static_cast<float>(gradient->cols);
 }
 
 void Layer::step(float learningRate)
 {
-    matrixScalarMultiply(gradweights, learningRate, gradweights);
-    matrixSubstract(&weights, gradweights, &weights);
+    step(learningRate, gradweights, gradbias);
+}
 
-    matrixScalarMultiply(gradbias, learningRate, gradbias);
-    matrixSubstract(&bias, gradbias, &bias);
+void Layer::step(float learningRate, Matrix *gradweights_, Matrix *gradbias_)
+{
+    weights -= learningRate * *gradweights_;
+    bias -= learningRate * *gradbias_;
+
+    // fine-tuning a pruned layer keeps the pruned weights at zero
+    if (!mask.data.empty())
+    {
+        matrixHadamard(&weights, &mask, &weights);
+    }
+
+    // the packed and csr copies only serve predict, repacking them every batch would cost a copy of
+    // the weights (and a csr rebuild when pruned) per training step
+    inferenceStale = true;
 }
 
 void Layer::print()
@@ -311,5 +504,10 @@ void Layer::information()
         break;
     }
 
-    std::cout << "Input Size: " << weights.cols << " Output Size: " << weights.rows << " Activation: " << activationString << std::endl;
+    std::cout << "Input Size: " << weights.cols << " Output Size: " << weights.rows << " Activation: " << activationString;
+    if (!mask.data.empty())
+    {
+        std::cout << " Sparsity: " << getSparsity() << " (" << getSparseWeights()->bytes() << " bytes as csr)";
+    }
+    std::cout << std::endl;
 }
\ No newline at end of file
@@ -3,6 +3,8 @@
 
 #include "matrix.h"
 
+#include <random>
+
 enum class ActivationType
 {
     SIGMOID,
@@ -16,13 +18,20 @@ public:
     Layer(uint inputSize_, uint outputSize_, ActivationType activationType_);
     void setPreviousLayer(Layer *layer_);
     void setSubsequentLayer(Layer *layer_);
-    void initWeights();
+    void initWeights(std::mt19937 &rng);
     void setInput(Matrix *input_);
-    void setGroundtruth(Matrix *groundtruth_);
+
+    // for callers that batch the input product of several layers (see Sweep):
+    // forward() takes weights * input from product_, calculateGradients() leaves gradweights to the caller
+    void setInputProduct(Matrix *product_);
+    void setExternalWeightGradient(bool external_);
 
     Matrix *getPredictionActivation();
     Matrix *getActivation();
     Matrix *getWeights();
+    Matrix *getBias();
+    Matrix *getGradWeights();
+    Matrix *getGradBias();
     Matrix *getGradient();
     Matrix *getWeightedInput();
 
@@ -33,21 +42,56 @@ public:
 
     ActivationType getActivationType();
 
+    void setParameters(const Matrix &weights_, const Matrix &bias_);
+    void weightsChanged();   // after writing getWeights() directly, rebuilds the derived copies predict uses
+    void prepareInference(); // rebuilds them if step() changed the weights since, call before predict()
+
+    // magnitude pruning: zeroes the fraction sparsity of blockRows x blockCols weight blocks with the
+    // smallest mean |w|, step() keeps them zero afterwards. predict() switches to the sparse kernel
+    // once the weights are sparse enough
+    void prune(float sparsity, uint blockRows = 1, uint blockCols = 1);
+    float getSparsity();
+    SparseMatrix *getSparseWeights();
+    PackedMatrix *getPackedWeights(); // for predict() on 1 to packedMaxCols samples
+    bool predictUsesGemm(uint cols);  // predict() on cols samples runs matrixMultiply (not sparse, not packed)
+
     void forward();
+    void forwardOutput(Matrix *labels, float *loss); // output layer: logits, loss, dL/dz and dL/db in one go
     void predict();
     void calculateGradients();
     void step(float learningRate);
 
+    // same math on caller-owned buffers, e.g. one set per micro-batch
+    void predict(Matrix *in, Matrix *weightedInput_, Matrix *activation_); // weightedInput_ may be activation_
+    void step(float learningRate, Matrix *gradweights_, Matrix *gradbias_);
+    void forward(Matrix *in, Matrix *weightedInput_, Matrix *activation_);
+    void forwardOutput(Matrix *in, Matrix *labels, Matrix *weightedInput_, Matrix *gradient_, Matrix *gradbias_, float *loss);
+    void output(Matrix *weightedInput_, Matrix *labels, Matrix *gradient_, Matrix *gradbias_, float *loss);
+    void hiddenGradient(Matrix *dA, Matrix *weightedInput_, Matrix *activation_, Matrix *gradient_, Matrix *gradbias_);
+    void activate(Matrix *weightedInput_, Matrix *activation_);
+    void hiddenGradient(Matrix *weightsNext, Matrix *gradientNext, Matrix *weightedInput_, Matrix *activation_, Matrix *gradient_, Matrix *gradbias_);
+
     void print();
     void information();
 
 private:
-    Matrix *input = nullptr;       // only used if layer is input layer
-    Matrix *groundtruth = nullptr; // only used if layer is output layer
+    bool predictUsesSparse();
+
+    Matrix *input = nullptr; // only used if layer is input layer
+    Matrix *inputProduct = nullptr;
+    bool externalWeightGradient = false;
 
     Matrix weights;
     Matrix bias;
 
+    // derived copies of the weights for predict, rebuilt by every change of the weights (weightsChanged)
+    // except the training steps, which only mark them stale until the next prepareInference
+    SparseMatrix sparseWeights; // only while pruned
+    PackedMatrix packedWeights;
+    bool inferenceStale = false;
+
+    Matrix mask; // pruning, 1 = kept, empty if the layer is not pruned
+
     // used during training
     Matrix *gradweights = nullptr;
     Matrix *gradbias = nullptr;
@@ -55,16 +99,14 @@ private:
     Matrix *weightedInput = nullptr;
     Matrix *activation = nullptr;
 
-    Matrix *tempSsWeightsT = nullptr;
-    Matrix *tempdZdA = nullptr;
     Matrix *tempPrActivationT = nullptr;
 
     // used during prediction
     Matrix *predictionWeightedInput = nullptr;
     Matrix *predictActivation = nullptr;
 
-    Layer *previousLayer;
-    Layer *subsequentLayer;
+    Layer *previousLayer = nullptr;
+    Layer *subsequentLayer = nullptr;
 
     ActivationType activationType;
 };
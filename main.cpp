@@ -1,41 +1,21 @@
+#include "allocation.h"
 #include "matrix.h"
 #include "layer.h"
 #include "model.h"
+#include "dataset.h"
+#include "checkpoint.h"
+#include "codegen.h"
+#include "counters.h"
+#include "dataparallel.h"
+#include "hogwild.h"
+#include "sweep.h"
+#include "validation.h"
 #include <iostream>
 #include <iomanip>
-
-void prepData(Matrix *inputTrain, Matrix *inputTest, Matrix **trainData, Matrix **labelsTrain, Matrix **testData, Matrix **labelsTest)
-{
-    /*
-        get labels
-    */
-
-    Matrix tempTrainLabels(inputTrain->rows, 1);
-    Matrix tempTestLabels(inputTest->rows, 1);
-
-    inputTrain->getCols(0, 1, &tempTrainLabels);
-    inputTest->getCols(0, 1, &tempTestLabels);
-
-    *labelsTrain = new Matrix(1, inputTrain->rows);
-    matrixTranspose(&tempTrainLabels, *labelsTrain);
-    *labelsTest = new Matrix(1, inputTest->rows);
-    matrixTranspose(&tempTestLabels, *labelsTest);
-
-    /*
-        get data
-    */
-
-    Matrix tempTrainData(inputTrain->rows, inputTrain->cols - 1);
-    Matrix tempTestData(inputTest->rows, inputTest->cols - 1);
-
-    inputTrain->getCols(1, inputTrain->cols, &tempTrainData);
-    inputTest->getCols(1, inputTest->cols, &tempTestData);
-
-    *trainData = new Matrix(inputTrain->cols - 1, inputTrain->rows);
-    matrixTranspose(&tempTrainData, *trainData);
-    *testData = new Matrix(inputTest->cols - 1, inputTest->rows);
-    matrixTranspose(&tempTestData, *testData);
-}
+#include <mutex>
+#include <string>
+#include <unistd.h>
+#include <vector>
 
 int main(void)
 {
@@ -49,52 +29,292 @@ int main(void)
     const int batchSize = 100;
     const float learningRate = 0.1f;
 
+    // > 1 runs forward / backward as a pipeline of layer stages on their own threads
+    const uint pipelineStages = 1;
+    const uint pipelineMicroBatches = 4;
+
+    // stream the training set from disk instead of loading it into memory
+    const bool streamTrainingData = false;
+    const size_t streamingMemoryBudget = 64 * 1024 * 1024;
+    const uint streamingShuffleWindow = 4;
+
+    // pixels are scaled to [0, 1], standardizeInputs also centers them on the mean of the training set
+    // and divides by its standard deviation (not available when streaming)
+    const float inputScale = 1.0f / 255.0f;
+    const bool standardizeInputs = false;
+
+    // the first validationSamples samples of the training file are held out as the validation set:
+    // validate on it in the background every validationInterval batches, stop once the accuracy has
+    // not improved for validationPatience validations. the test set is only used for the final accuracy
+    const uint validationSamples = 1000;
+    const int validationInterval = 100;
+    const uint validationPatience = 10;
+
+    // > 0 prunes this fraction of the weights (in blocks of pruningBlock x pruningBlock) before the
+    // last pruningFineTuneEpochs epochs, which then fine-tune the remaining weights
+    const float pruningSparsity = 0.0f;
+    const uint pruningBlock = 1;
+    const int pruningFineTuneEpochs = 1;
+
+    // write the training state to checkpointFile every checkpointInterval batches and at the end
+    // of every epoch, resumeCheckpoint continues from an existing one instead of training from scratch
+    const char *checkpointFile = "training.ckpt";
+    const int checkpointInterval = 100;
+    const bool resumeCheckpoint = false;
+
+    // != nullptr exports the trained model as standalone c++ (<exportBasename>.h / .cpp), see codegen.h
+    const char *exportBasename = nullptr;
+
+    // > 1 trains in that many processes on one host, every process takes every n-th batch and the
+    // gradients are averaged through shared memory (dataparallel.h)
+    const uint dataParallelProcesses = 1;
+
+    // compare serial sgd against lock-free asynchronous sgd (hogwild.h) on the training set, then exit
+    const bool hogwildReport = false;
+
+    // train every configuration of sweepConfigs at once on the training set (sweep.h, the first layers
+    // share one stacked gemm), report their loss per epoch and validation accuracy, then exit
+    const bool sweepReport = false;
+    std::vector<SweepConfig> sweepConfigs(4);
+    sweepConfigs[0].hiddenSizes = {64, 32};
+    sweepConfigs[1].hiddenSizes = {128, 32};
+    sweepConfigs[2].hiddenSizes = {64, 32};
+    sweepConfigs[2].learningRate = 0.05f;
+    sweepConfigs[3].hiddenSizes = {128};
+    sweepConfigs[3].hiddenActivation = ActivationType::RELU;
+
+    // count matrix and dataset allocations per phase and layer, report them at the end
+    const bool trackAllocations = false;
+
+    // hardware counters (cycles, instructions, cache and branch misses) per kernel, phase and layer, see counters.h
+    const bool collectCounters = false;
+
+    // benchmark gemm blockings for the shapes of the model and keep the fastest in autotuneCacheFile
+    // (reused by later runs on the same cpu); costs several seconds the first time
+    const bool autotuneGemm = false;
+    const char *autotuneCacheFile = "gemm_tuning.cache";
+
+    // back matrices and datasets of 2 MiB and more with transparent huge pages, fewer TLB misses on large datasets
+    const bool hugePages = false;
+
+    allocationSetTracking(trackAllocations);
+    allocationSetHugePages(hugePages);
+    if (collectCounters && !countersSetEnabled(true))
+    {
+        std::cout << "hardware counters unavailable, timing kernels only" << std::endl;
+    }
+
+    auto addLayers = [&](Model *m)
+    {
+        m->addLayer(new Layer(mnistDataSize, 64, ActivationType::SIGMOID));
+        m->addLayer(new Layer(64, 32, ActivationType::SIGMOID));
+        m->addLayer(new Layer(32, mnistClasses, ActivationType::SOFTMAX));
+    };
+
     /*
         data preparation
     */
 
-    Matrix *train = matrixLoad("../mnist_train.txt");
-    Matrix *test = matrixLoad("../mnist_test.txt");
+    allocationSetPhase("load");
+    ByteDataset *trainSet = nullptr;
+    ChunkedDataset *trainStream = nullptr;
+    Normalization inputNormalization;
+    inputNormalization.scale = inputScale;
+    Matrix *validationData = new Matrix(mnistDataSize, validationSamples);
+    Matrix *labelsValidation = new Matrix(1, validationSamples);
+    uint trainSamples = 0;
+
+    if (streamTrainingData)
+    {
+        trainStream = new ChunkedDataset("../mnist_train.txt", mnistDataSize, streamingMemoryBudget, streamingShuffleWindow);
+        if (!trainStream->isOpen())
+        {
+            std::cerr << "Error: could not open mnist dataset" << std::endl;
+            return 1;
+        }
+        trainStream->setNormalization(inputNormalization);
+        if (!trainStream->holdOut(validationSamples, validationData, labelsValidation))
+        {
+            return 1;
+        }
+        trainSamples = trainStream->getSampleCount();
+        std::cout << "Train data: " << trainSamples << " samples streamed in shards of " << trainStream->getShardSize() << std::endl;
+    }
+    else
+    {
+        trainSet = new ByteDataset("../mnist_train.txt", mnistDataSize);
+        if (!trainSet->isOpen())
+        {
+            std::cerr << "Error: could not load mnist dataset" << std::endl;
+            return 1;
+        }
+
+        if (trainSet->getSampleCount() <= validationSamples)
+        {
+            std::cerr << "Error: " << trainSet->getSampleCount() << " samples leave none for training after the validation set" << std::endl;
+            return 1;
+        }
 
-    Matrix *trainData = nullptr;
-    Matrix *labelsTrain = nullptr;
-    Matrix *testData = nullptr;
-    Matrix *labelsTest = nullptr;
+        if (standardizeInputs)
+        {
+            inputNormalization = trainSet->standardization(inputScale);
+        }
+        trainSet->assembleBatch(0, validationSamples, inputNormalization, validationData, labelsValidation);
+        trainSamples = trainSet->getSampleCount() - validationSamples;
+        std::cout << "Train data: " << trainSamples << " samples, " << trainSet->getMemoryUsage() / 1024 << " KiB" << std::endl;
+    }
 
-    if (train == nullptr || test == nullptr)
+    ByteDataset testSet("../mnist_test.txt", mnistDataSize);
+    if (!testSet.isOpen())
     {
         std::cerr << "Error: could not load mnist dataset" << std::endl;
         return 1;
     }
 
-    prepData(train, test, &trainData, &labelsTrain, &testData, &labelsTest);
+    // the test set is evaluated as a whole, convert it once
+    allocationSetPhase("prep");
+    Matrix *testData = new Matrix(mnistDataSize, testSet.getSampleCount());
+    Matrix *labelsTest = new Matrix(1, testSet.getSampleCount());
+    testSet.assembleBatch(0, testSet.getSampleCount(), inputNormalization, testData, labelsTest);
+
+    std::cout << "Validation data: " << validationData->shape() << " " << labelsValidation->shape() << std::endl;
+    std::cout << "Test data: " << testData->shape() << " " << labelsTest->shape() << std::endl;
 
-    Matrix *OHlabelsTrain = new Matrix(mnistClasses, labelsTrain->cols);
-    Matrix *OHlabelsTest = new Matrix(mnistClasses, labelsTest->cols);
+    if ((hogwildReport || sweepReport || dataParallelProcesses > 1) && trainSet == nullptr)
+    {
+        std::cerr << "Error: hogwildReport, sweepReport and dataParallelProcesses need the training set in memory, not streamed" << std::endl;
+        return 1;
+    }
 
-    matrixOneHot(labelsTrain, OHlabelsTrain, mnistClasses);
-    matrixOneHot(labelsTest, OHlabelsTest, mnistClasses);
+    if (hogwildReport)
+    {
+        Matrix trainData(mnistDataSize, trainSamples);
+        Matrix trainLabels(1, trainSamples);
+        trainSet->assembleBatch(validationSamples, trainSamples, inputNormalization, &trainData, &trainLabels);
+
+        Model serial(1), hogwild(1);
+        addLayers(&serial);
+        addLayers(&hogwild);
+        hogwildCompare(&serial, &hogwild, &trainData, &trainLabels, testData, labelsTest, batchSize, learningRate, epochs).print(std::cout);
+        return 0;
+    }
 
-    std::cout << "Train data: " << trainData->shape() << " " << OHlabelsTrain->shape() << std::endl;
-    std::cout << "Test data: " << testData->shape() << " " << OHlabelsTest->shape() << std::endl;
+    if (sweepReport)
+    {
+        Matrix trainData(mnistDataSize, trainSamples);
+        Matrix trainLabels(1, trainSamples);
+        trainSet->assembleBatch(validationSamples, trainSamples, inputNormalization, &trainData, &trainLabels);
+
+        Sweep sweep(mnistDataSize, mnistClasses, batchSize);
+        for (const SweepConfig &config : sweepConfigs)
+        {
+            sweep.addModel(config);
+        }
+        sweep.initTraining();
+
+        std::vector<float> losses;
+        for (int e = 0; e < epochs; e++)
+        {
+            sweep.trainEpoch(&trainData, &trainLabels, &losses);
+            std::cout << "epoch " << e << " loss:";
+            for (float loss : losses)
+            {
+                std::cout << " " << loss;
+            }
+            std::cout << std::endl;
+        }
+
+        Matrix pred(mnistClasses, validationData->cols);
+        Matrix indexpred(1, validationData->cols);
+        for (uint m = 0; m < sweep.getModelCount(); m++)
+        {
+            float accuracy;
+            sweep.getModel(m)->predict(validationData, &pred);
+            matrixArgMax(&pred, &indexpred);
+            matrixAccuracy(&indexpred, labelsValidation, &accuracy);
+            std::cout << "config " << m << " validation accuracy: " << accuracy << std::endl;
+        }
+        return 0;
+    }
+
+    if (dataParallelProcesses > 1)
+    {
+        std::string group = "machinelearning-" + std::to_string(getpid());
+        return dataParallelLaunch(dataParallelProcesses, [&](uint rank)
+                                  {
+            dataParallelPin(rank, dataParallelProcesses);
+
+            Model replica;
+            addLayers(&replica);
+            replica.initTraining(batchSize);
+            DataParallel parallel(&replica, group, rank, dataParallelProcesses);
+            if (!parallel.isOpen() || !parallel.broadcastParameters())
+                return 1;
+
+            const int rounds = trainSamples / batchSize / dataParallelProcesses;
+            Matrix batch(mnistDataSize, batchSize);
+            Matrix batchLabels(1, batchSize);
+            for (int e = 0; e < epochs; e++)
+            {
+                float lossSum = 0.0f;
+                for (int r = 0; r < rounds; r++)
+                {
+                    float loss;
+                    trainSet->assembleBatch(validationSamples + (r * dataParallelProcesses + rank) * batchSize, batchSize, inputNormalization, &batch, &batchLabels);
+                    if (!parallel.forwardBackward(&batch, &batchLabels, &loss))
+                        return 1;
+                    replica.step(learningRate);
+
+                    lossSum += loss;
+                    if (rank == 0)
+                        replica.printProgress(e, r, rounds, lossSum / static_cast<float>(r + 1));
+                }
+            }
+
+            if (rank == 0)
+            {
+                float accuracy;
+                Matrix pred(mnistClasses, testData->cols);
+                Matrix indexpred(1, testData->cols);
+                replica.predict(testData, &pred);
+                matrixArgMax(&pred, &indexpred);
+                matrixAccuracy(&indexpred, labelsTest, &accuracy);
+                std::cout << "accuracy after training in " << dataParallelProcesses << " processes: " << accuracy << std::endl;
+            }
+            return 0; });
+    }
 
     /*
         model creation
     */
 
+    allocationSetPhase("setup");
     Model model;
 
-    model.addLayer(new Layer(mnistDataSize, 64, ActivationType::SIGMOID));
-    model.addLayer(new Layer(64, 32, ActivationType::SIGMOID));
-    model.addLayer(new Layer(32, mnistClasses, ActivationType::SOFTMAX));
+    addLayers(&model);
 
     model.information();
+    std::cout << "kernels: " << matrixIsaName(matrixGetIsaLevel()) << "\n"
+              << std::endl;
+    if (autotuneGemm)
+    {
+        model.enableAutotuning(autotuneCacheFile);
+    }
     model.initTraining(batchSize);
+    model.enablePipeline(pipelineStages, pipelineMicroBatches);
+
+    Checkpointer checkpointer(checkpointFile);
+    TrainingState resumeState;
+    if (resumeCheckpoint && checkpointer.resume(&model, &resumeState))
+    {
+        std::cout << "resumed from " << checkpointFile << " at epoch " << resumeState.epoch << " batch " << resumeState.batch << std::endl;
+    }
 
     float accuracy;
     Matrix pred(mnistClasses, testData->cols);
     Matrix indexpred(1, testData->cols);
 
+    allocationSetPhase("predict");
     model.predict(testData, &pred);
     matrixArgMax(&pred, &indexpred);
     matrixAccuracy(&indexpred, labelsTest, &accuracy);
@@ -105,49 +325,132 @@ int main(void)
         training
     */
 
-    const int numBatches = trainData->cols / batchSize;
+    const int numBatches = trainSamples / batchSize;
+
+    std::mutex validationMutex;
+    std::vector<ValidationResult> validationCurve;
+    AsyncValidator validator(validationData, labelsValidation, 1000, [&](const ValidationResult &result)
+                             {
+                                 std::lock_guard<std::mutex> lock(validationMutex);
+                                 validationCurve.push_back(result); });
+    validator.setEarlyStopping(validationPatience);
 
-    for (int e = 0; e < epochs; e++)
+    bool pruned = false;
+    for (int e = resumeState.epoch; e < epochs && !validator.shouldStop(); e++)
     {
         float lossSum = 0.0f;
 
-        for (int b = 0; b < numBatches; b++)
+        // after a resume the weights pruned before are the smallest, pruning again restores the mask
+        if (pruningSparsity > 0.0f && !pruned && e >= epochs - pruningFineTuneEpochs)
         {
-            float loss;
-            Matrix batch(trainData->rows, batchSize);
-            Matrix batchGroundTruthOneHot(mnistClasses, batchSize);
+            model.prune(pruningSparsity, pruningBlock, pruningBlock);
+            pruned = true;
+            std::cout << "pruned " << pruningSparsity * 100.0f << "% of the weights" << std::endl;
+        }
+        int firstBatch = e == resumeState.epoch ? resumeState.batch : 0;
 
-            trainData->getCols(b * batchSize, b * batchSize + batchSize, &batch);
-            OHlabelsTrain->getCols(b * batchSize, b * batchSize + batchSize, &batchGroundTruthOneHot);
+        if (streamTrainingData)
+        {
+            // the shuffled order is not part of the checkpoint, a resumed epoch only skips as many batches
+            trainStream->reset();
+            Matrix batch(mnistDataSize, batchSize);
+            Matrix batchLabels(1, batchSize);
+            for (int b = 0; b < firstBatch; b++)
+            {
+                trainStream->nextBatch(&batch, &batchLabels);
+            }
+        }
 
-            model.forward(&batch, &batchGroundTruthOneHot, &loss);
+        for (int b = firstBatch; b < numBatches; b++)
+        {
+            allocationSetPhase("train step");
+            float loss;
+            Matrix batch(mnistDataSize, batchSize);
+            Matrix batchLabels(1, batchSize);
+
+            if (streamTrainingData)
+            {
+                if (!trainStream->nextBatch(&batch, &batchLabels))
+                {
+                    if (trainStream->hasError())
+                        return 1;
+                    break;
+                }
+            }
+            else
+            {
+                trainSet->assembleBatch(validationSamples + b * batchSize, batchSize, inputNormalization, &batch, &batchLabels);
+            }
+
+            model.forwardBackward(&batch, &batchLabels, &loss);
             lossSum += loss;
-            model.printProgress(e, b, numBatches, lossSum / static_cast<float>(b));
+            model.printProgress(e, b, numBatches, lossSum / static_cast<float>(b - firstBatch + 1));
 
-            model.calculateGradients(&batch, &batchGroundTruthOneHot);
             model.step(learningRate);
+
+            if ((b + 1) % checkpointInterval == 0 || b + 1 == numBatches)
+            {
+                TrainingState state;
+                state.epoch = b + 1 == numBatches ? e + 1 : e;
+                state.batch = b + 1 == numBatches ? 0 : b + 1;
+                state.learningRate = learningRate;
+                checkpointer.save(&model, state);
+            }
+
+            if (b % validationInterval == 0)
+            {
+                validator.submit(&model, e, b);
+            }
+            if (validator.shouldStop())
+            {
+                std::cout << "\nearly stopping, restoring best validation accuracy " << validator.getBest().accuracy;
+                validator.restoreBest(&model);
+                break;
+            }
         }
         std::cout << std::endl;
     }
 
+    validator.wait();
+    checkpointer.wait();
+    std::cout << "validation curve (epoch, batch, accuracy, loss):" << std::endl;
+    for (ValidationResult &result : validationCurve)
+    {
+        std::cout << result.epoch << " " << result.batch << " " << result.accuracy << " " << result.loss << std::endl;
+    }
+
     /*
         calculate accuracy on test data
     */
 
+    allocationSetPhase("predict");
     model.predict(testData, &pred);
     matrixArgMax(&pred, &indexpred);
     matrixAccuracy(&indexpred, labelsTest, &accuracy);
     std::cout << "accuracy after training: " << accuracy << std::endl;
 
+    if (pruned)
+    {
+        model.information();
+    }
+
+    if (exportBasename != nullptr && codegenExport(&model, exportBasename))
+    {
+        std::cout << "exported the model to " << exportBasename << ".cpp" << std::endl;
+    }
+
     /*
         display and predict a few numbers
     */
 
     for (int k = 0; k < 10; k++)
     {
+        Matrix pixels(mnistDataSize, 1);
+        testSet.assembleBatch(k, 1, Normalization(), &pixels, nullptr);
+        matrixPrintMNIST(&pixels);
+
         Matrix number(mnistDataSize, 1);
         testData->getCols(k, k + 1, &number);
-        matrixPrintMNIST(&number);
 
         Matrix prediction(mnistClasses, 1);
         Matrix predT(1, mnistClasses);
@@ -161,5 +464,14 @@ int main(void)
                   << std::endl;
     }
 
+    if (trackAllocations)
+    {
+        allocationReport(std::cout);
+    }
+    if (collectCounters)
+    {
+        countersReport(std::cout);
+    }
+
     return 0;
 }
\ No newline at end of file
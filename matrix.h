@@ -1,20 +1,26 @@
 #ifndef MATRIX_H
 #define MATRIX_H
 
+#include "allocation.h"
+
 #include <cstdint>
 #include <vector>
 #include <string>
 
 typedef uint32_t uint;
 
+/*
+    rows and cols are 32 bit, the number of elements and every offset into data are size_t:
+    a 1000 x 20M matrix has 2e10 elements, so index with static_cast<size_t>(i) * cols + j
+*/
 struct Matrix
 {
     uint cols = 0;
     uint rows = 0;
-    std::vector<float> data = {}; // data[row * cols + col] = data[i * cols + j] = data[i][j]
+    std::vector<float, TrackedAllocator<float>> data = {}; // data[row * cols + col] = data[i * cols + j] = data[i][j]
 
     Matrix();
-    Matrix(uint rows_, uint cols_, float value_ = 0.0f);
+    Matrix(uint rows_, uint cols_, float value_ = 0.0f); // throws std::length_error if rows_ * cols_ does not fit size_t
     Matrix(uint rows_, uint cols_, std::vector<float> data);
 
     void getCols(uint startIndex, uint endIndex, Matrix *out);
@@ -24,6 +30,80 @@ struct Matrix
     std::string shape();
 };
 
+// compressed sparse row: the nonzeros of row i are values[rowPtr[i] .. rowPtr[i + 1]) in columns colIndex[...]
+struct SparseMatrix
+{
+    uint rows = 0;
+    uint cols = 0;
+    std::vector<uint, TrackedAllocator<uint>> rowPtr = {};
+    std::vector<uint, TrackedAllocator<uint>> colIndex = {};
+    std::vector<float, TrackedAllocator<float>> values = {};
+
+    size_t bytes();
+};
+
+// weights repacked for matrixMultiplyPacked: panels of packedPanelRows rows stored column by column
+// (data[(panel * cols + k) * packedPanelRows + r]), the last panel is padded with zeros
+const uint packedPanelRows = 16;
+const uint packedMaxCols = 8; // widest right-hand side matrixMultiplyPacked takes
+
+struct PackedMatrix
+{
+    uint rows = 0;
+    uint cols = 0;
+    std::vector<float, TrackedAllocator<float>> data = {};
+};
+
+// rows * cols, false if it overflows size_t (only possible where size_t is 32 bit)
+bool matrixElements(uint rows, uint cols, size_t *elements);
+
+/*
+    instruction set level of the hot kernels, detected once at startup via cpuid
+    (override with the environment variable ML_ISA=scalar|sse|avx2|avx512)
+*/
+enum class IsaLevel
+{
+    SCALAR,
+    SSE,
+    AVX2,
+    AVX512
+};
+
+IsaLevel matrixDetectIsaLevel();
+IsaLevel matrixGetIsaLevel();
+void matrixSetIsaLevel(IsaLevel level); // call before any kernel runs concurrently
+const char *matrixIsaName(IsaLevel level);
+
+/*
+    blocking of matrixMultiply, chosen per shape (see autotune.h)
+*/
+enum class GemmLoopOrder
+{
+    IJK, // dot products, best for very narrow outputs
+    IKJ  // row updates, contiguous inner loop over the output columns
+};
+
+struct GemmConfig
+{
+    GemmLoopOrder loopOrder = GemmLoopOrder::IKJ;
+    uint tileRows = 64;
+    uint tileCols = 256;
+    uint tileDepth = 256;
+    uint threads = 1;
+    uint strassenCutoff = 0; // > 0: Strassen-Winograd recursion while all dimensions are at least this large
+};
+
+GemmConfig matrixDefaultGemmConfig(uint rows, uint depth, uint cols);
+void matrixSetGemmConfig(uint rows, uint depth, uint cols, GemmConfig config);
+bool matrixGetGemmConfig(uint rows, uint depth, uint cols, GemmConfig *config);
+void matrixMultiplyConfig(Matrix *in1, Matrix *in2, Matrix *out, const GemmConfig &config);
+
+// Strassen-Winograd: 7 half-size products per level instead of 8, the blocked kernel of config below the cutoff.
+// the error grows with the recursion depth, matrixStrassenError measures it against the blocked kernel
+// on random data as max |difference| / max |reference|
+void matrixMultiplyStrassen(Matrix *in1, Matrix *in2, Matrix *out, const GemmConfig &config);
+float matrixStrassenError(uint rows, uint depth, uint cols, const GemmConfig &config);
+
 /*
     standard matrix operators
 */
@@ -51,6 +131,14 @@ void matrixCategoricalCrossEntropy(Matrix *in, Matrix *groundtruth, float *loss)
 void matrixMSE(Matrix *in, Matrix *groundtruth, float *loss);
 void matrixLogLoss(Matrix *in, Matrix *groundtruth, float *loss);
 
+// softmax + categorical cross entropy from the logits in one pass: mean loss, dL/dz and dL/db (row mean),
+// labels holds the class indices (1 x cols)
+void matrixSoftMaxCrossEntropy(Matrix *logits, Matrix *labels, Matrix *gradient, Matrix *gradbias, float *loss);
+
+// the same for sigmoid + log loss and relu + mse against the one hot encoding of labels (native kernels)
+void matrixSigmoidLogLoss(Matrix *logits, Matrix *labels, Matrix *gradient, Matrix *gradbias, float *loss);
+void matrixReLuMSE(Matrix *logits, Matrix *labels, Matrix *gradient, Matrix *gradbias, float *loss);
+
 /*
     cost functions
 */
@@ -71,4 +159,25 @@ void matrixSigmoidDerivative(Matrix *activation, Matrix *gradient);
 void matrixReLuDerivative(Matrix *wIn, Matrix *gradient);
 void matrixSoftMaxCCECombinedDerivative(Matrix *activation, Matrix *groundtruthIndex, Matrix *gradient);
 
+/*
+    fused backward kernels: dL/dz and the bias gradient (row mean) in one pass,
+    the Gemm variants first compute dL/da = weightsNext^T * gradientNext with matrixMultiply
+*/
+void matrixSigmoidBackward(Matrix *dA, Matrix *activation, Matrix *gradient, Matrix *gradbias);
+void matrixReLuBackward(Matrix *dA, Matrix *weightedInput, Matrix *gradient, Matrix *gradbias);
+void matrixSigmoidBackwardGemm(Matrix *weightsNext, Matrix *gradientNext, Matrix *activation, Matrix *gradient, Matrix *gradbias);
+void matrixReLuBackwardGemm(Matrix *weightsNext, Matrix *gradientNext, Matrix *weightedInput, Matrix *gradient, Matrix *gradbias);
+
+/*
+    gemv / skinny gemm for 1 to packedMaxCols columns on prepacked weights
+*/
+void matrixPack(Matrix *in, PackedMatrix *out);
+void matrixMultiplyPacked(PackedMatrix *in1, Matrix *in2, Matrix *out);
+
+/*
+    sparse matrices
+*/
+void matrixToSparse(Matrix *in, SparseMatrix *out); // keeps the nonzeros
+void matrixSparseMultiply(SparseMatrix *in1, Matrix *in2, Matrix *out);
+
 #endif
\ No newline at end of file
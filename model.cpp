@@ -1,11 +1,68 @@
 #include "model.h"
 #include <iostream>
 #include <iomanip>
+#include <cassert>
 
-Model::Model()
+Model::Model() : rng(std::random_device()())
 {
 }
 
+Model::Model(uint seed) : rng(seed)
+{
+}
+
+Model::~Model()
+{
+    delete pipeline;
+    delete autotuner;
+}
+
+void Model::enableAutotuning(const char *cacheFile)
+{
+    delete autotuner;
+    autotuner = new GemmAutotuner(cacheFile);
+    tunedPredictionSizes.clear();
+}
+
+void Model::tuneTraining(int batchSize)
+{
+    if (autotuner == nullptr)
+        return;
+
+    for (int i = 0; i < layers.size(); i++)
+    {
+        Matrix *weights = layers[i]->getWeights();
+
+        // forward: W * A_prev, gradweights: dL/dz * A_prev^T
+        autotuner->tune(weights->rows, weights->cols, batchSize);
+        autotuner->tune(weights->rows, batchSize, weights->cols);
+
+        // backward through the subsequent layer: W_next^T * dL/dz_next (matrix*BackwardGemm)
+        if (i + 1 < layers.size())
+        {
+            autotuner->tune(weights->rows, layers[i + 1]->getWeights()->rows, batchSize);
+        }
+    }
+    autotuner->save();
+}
+
+void Model::tunePrediction(int batchSize)
+{
+    // once per batch size, only the layers whose predict runs the dense gemm on it
+    if (autotuner == nullptr || !tunedPredictionSizes.insert(batchSize).second)
+        return;
+
+    for (int i = 0; i < layers.size(); i++)
+    {
+        if (layers[i]->predictUsesGemm(batchSize))
+        {
+            Matrix *weights = layers[i]->getWeights();
+            autotuner->tune(weights->rows, weights->cols, batchSize);
+        }
+    }
+    autotuner->save();
+}
+
 void Model::addLayer(Layer *layer)
 {
     if (layers.empty())
@@ -16,14 +73,25 @@ void Model::addLayer(Layer *layer)
     {
         layer->setPreviousLayer(layers.back());
     }
-    layer->initWeights();
+    layer->initWeights(rng);
     layers.push_back(layer);
 }
 
+Layer *Model::getLayer(int index)
+{
+    return layers[index];
+}
+
+int Model::getLayerCount()
+{
+    return layers.size();
+}
+
 void Model::allocateLayersTraining(int size)
 {
     for (int i = 0; i < layers.size(); i++)
     {
+        AllocationScope scope("layer", i);
         layers[i]->allocateMatricesTraining(size);
     }
 }
@@ -32,6 +100,7 @@ void Model::allocateLayersPrediction(int size)
 {
     for (int i = 0; i < layers.size(); i++)
     {
+        AllocationScope scope("layer", i);
         layers[i]->allocateMatricesPrediction(size);
     }
 }
@@ -40,6 +109,7 @@ void Model::freeLayersTraining()
 {
     for (int i = 0; i < layers.size(); i++)
     {
+        AllocationScope scope("layer", i);
         layers[i]->freeMatricesTraining();
     }
 }
@@ -48,17 +118,24 @@ void Model::freeLayersPrediction()
 {
     for (int i = 0; i < layers.size(); i++)
     {
+        AllocationScope scope("layer", i);
         layers[i]->freeMatricesPrediction();
     }
 }
 
 void Model::predict(Matrix *data, Matrix *prediction)
 {
+    for (int i = 0; i < layers.size(); i++)
+    {
+        layers[i]->prepareInference();
+    }
+    tunePrediction(data->cols);
     allocateLayersPrediction(data->cols);
     layers.front()->setInput(data);
 
     for (int i = 0; i < layers.size(); i++)
     {
+        AllocationScope scope("layer", i);
         layers[i]->predict();
     }
 
@@ -66,51 +143,143 @@ void Model::predict(Matrix *data, Matrix *prediction)
     freeLayersPrediction();
 }
 
-void Model::forward(Matrix *data, Matrix *groundtruth, float *loss)
+void Model::forward(Matrix *data, Matrix *labels, float *loss)
 {
     layers.front()->setInput(data);
 
-    for (int i = 0; i < layers.size(); i++)
+    for (int i = 0; i < layers.size() - 1; i++)
     {
+        AllocationScope scope("layer", i);
         layers[i]->forward();
     }
 
-    // lossfunction
-    switch (layers.back()->getActivationType())
-    {
-    case ActivationType::RELU:
-        matrixMSE(layers.back()->getActivation(), groundtruth, loss);
-        break;
-
-    case ActivationType::SIGMOID:
-        matrixLogLoss(layers.back()->getActivation(), groundtruth, loss);
-        break;
-
-    case ActivationType::SOFTMAX:
-        matrixCategoricalCrossEntropy(layers.back()->getActivation(), groundtruth, loss);
-        break;
-    }
+    // lossfunction, also yields dL/dz of the output layer
+    AllocationScope scope("layer", layers.size() - 1);
+    layers.back()->forwardOutput(labels, loss);
 }
 
-void Model::calculateGradients(Matrix *input, Matrix *groundtruth)
+void Model::calculateGradients(Matrix *input)
 {
-    layers.back()->setGroundtruth(groundtruth);
     layers.front()->setInput(input);
 
     for (int i = layers.size() - 1; i >= 0; i--)
     {
+        AllocationScope scope("layer", i);
         layers[i]->calculateGradients();
     }
 }
 
+void Model::forwardBackward(Matrix *data, Matrix *labels, float *loss)
+{
+    if (pipeline != nullptr)
+    {
+        pipeline->forwardBackward(data, labels, loss);
+        return;
+    }
+
+    forward(data, labels, loss);
+    calculateGradients(data);
+}
+
+void Model::enablePipeline(uint stages, uint microBatches)
+{
+    // needs the gradient buffers of initTraining
+    assert(trainingBatchSize > 0);
+
+    delete pipeline;
+    pipeline = nullptr;
+    if (stages > 1)
+    {
+        pipeline = new Pipeline(layers, stages, microBatches, trainingBatchSize);
+        tuneTraining(trainingBatchSize / microBatches);
+    }
+}
+
 void Model::step(float learningRate)
 {
     for (int i = 0; i < layers.size(); i++)
     {
+        AllocationScope scope("layer", i);
         layers[i]->step(learningRate);
     }
 }
 
+void Model::prune(float sparsity, uint blockRows, uint blockCols)
+{
+    for (int i = 0; i < layers.size(); i++)
+    {
+        layers[i]->prune(sparsity, blockRows, blockCols);
+    }
+}
+
+void Model::snapshot(ModelSnapshot *out)
+{
+    // copy assignment reuses the buffers of a previous snapshot of the same model
+    out->layers.resize(layers.size());
+    for (int i = 0; i < layers.size(); i++)
+    {
+        out->layers[i].weights = *layers[i]->getWeights();
+        out->layers[i].bias = *layers[i]->getBias();
+        out->layers[i].activationType = layers[i]->getActivationType();
+    }
+}
+
+void Model::restore(const ModelSnapshot &snapshot)
+{
+    assert(snapshot.layers.size() == layers.size());
+    for (int i = 0; i < layers.size(); i++)
+    {
+        layers[i]->setParameters(snapshot.layers[i].weights, snapshot.layers[i].bias);
+    }
+}
+
+const std::mt19937 &Model::getRng()
+{
+    return rng;
+}
+
+void Model::setRng(const std::mt19937 &rng_)
+{
+    rng = rng_;
+}
+
+void ModelSnapshot::predict(Matrix *data, Matrix *prediction)
+{
+    // the activation buffers are kept for the next call with the same number of columns
+    activations.resize(layers.size());
+
+    Matrix *in = data;
+    for (int i = 0; i < layers.size(); i++)
+    {
+        LayerSnapshot &layer = layers[i];
+        Matrix *out = &activations[i];
+        if (out->rows != layer.weights.rows || out->cols != data->cols)
+        {
+            *out = Matrix(layer.weights.rows, data->cols);
+        }
+
+        matrixMultiply(&layer.weights, in, out);
+        matrixVectorAdd(out, &layer.bias, out);
+
+        switch (layer.activationType)
+        {
+        case ActivationType::SIGMOID:
+            matrixSigmoid(out, out);
+            break;
+
+        case ActivationType::RELU:
+            matrixReLu(out, out);
+            break;
+
+        case ActivationType::SOFTMAX:
+            matrixSoftMax(out, out);
+            break;
+        }
+        in = out;
+    }
+    *prediction = *in;
+}
+
 void Model::print()
 {
     for (int i = 0; i < layers.size(); i++)
@@ -173,6 +342,8 @@ float Model::calculateCost(Matrix *layerOutput, Matrix *groundtruth)
 
 void Model::initTraining(int batchSize)
 {
+    trainingBatchSize = batchSize;
+
     for (int i = 0; i < layers.size() - 1; i++)
     {
         layers[i]->setSubsequentLayer(layers[i + 1]);
@@ -181,6 +352,9 @@ void Model::initTraining(int batchSize)
 
     for (int i = 0; i < layers.size(); i++)
     {
+        AllocationScope scope("layer", i);
         layers[i]->allocateMatricesTraining(batchSize);
     }
+
+    tuneTraining(batchSize);
 }
\ No newline at end of file
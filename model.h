@@ -1,22 +1,56 @@
 #ifndef MODEL_H
 #define MODEL_H
 
+#include "autotune.h"
 #include "layer.h"
 #include "matrix.h"
+#include "pipeline.h"
 
+#include <random>
+#include <set>
 #include <vector>
 
+// parameters of all layers at one point in time, evaluated independently of the Model
+struct LayerSnapshot
+{
+    Matrix weights;
+    Matrix bias;
+    ActivationType activationType;
+};
+
+struct ModelSnapshot
+{
+    std::vector<LayerSnapshot> layers;
+    std::vector<Matrix> activations; // workspace of predict
+
+    void predict(Matrix *data, Matrix *prediction);
+};
+
 class Model
 {
 public:
     Model();
+    explicit Model(uint seed);
+    ~Model();
     void addLayer(Layer *layer);
+    Layer *getLayer(int index);
+    int getLayerCount();
+    void enableAutotuning(const char *cacheFile);
     void initTraining(int batchSize);
 
-    void forward(Matrix *data, Matrix *groundtruth, float *loss);
+    // labels hold the class index of every sample (1 x samples)
+    void forward(Matrix *data, Matrix *labels, float *loss);
     void predict(Matrix *data, Matrix *prediction);
-    void calculateGradients(Matrix *input, Matrix *groundtruth);
+    void calculateGradients(Matrix *input);
+    void forwardBackward(Matrix *data, Matrix *labels, float *loss);
+    void enablePipeline(uint stages, uint microBatches);
     void step(float learningRate);
+    void prune(float sparsity, uint blockRows = 1, uint blockCols = 1); // every layer, see Layer::prune
+
+    void snapshot(ModelSnapshot *out);
+    void restore(const ModelSnapshot &snapshot);
+    const std::mt19937 &getRng();
+    void setRng(const std::mt19937 &rng_);
 
     void print();
     void printProgress(int epoch, int batch, int batchesPerEpoch, float loss);
@@ -27,12 +61,19 @@ public:
 
 private:
     std::vector<Layer *> layers;
+    std::mt19937 rng;
+    GemmAutotuner *autotuner = nullptr;
+    std::set<int> tunedPredictionSizes;
+    Pipeline *pipeline = nullptr;
+    int trainingBatchSize = 0;
 
     float calculateCost(Matrix *layerOutput, Matrix *groundtruth);
     void allocateLayersTraining(int size);
     void allocateLayersPrediction(int size);
     void freeLayersTraining();
     void freeLayersPrediction();
+    void tuneTraining(int batchSize);
+    void tunePrediction(int batchSize);
 };
 
 #endif
\ No newline at end of file
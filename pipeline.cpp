@@ -0,0 +1,319 @@
+#include "pipeline.h"
+#include "expression.h"
+#include <algorithm>
+#include <cassert>
+
+namespace
+{
+    template <typename T>
+    T waitPop(SpscQueue<T> *queue)
+    {
+        T value;
+        while (!queue->pop(&value))
+        {
+            std::this_thread::yield();
+        }
+        return value;
+    }
+}
+
+Pipeline::Pipeline(const std::vector<Layer *> &layers_, uint stageCount, uint microBatches_, uint batchSize_) : layers(layers_),
+                                                                                                                microBatches(microBatches_)
+{
+    assert(!layers.empty());
+    assert(microBatches > 0 && batchSize_ % microBatches == 0);
+    microBatchSize = batchSize_ / microBatches;
+    stageCount = std::max(1u, std::min(stageCount, static_cast<uint>(layers.size())));
+
+    /*
+        split the layers into stages of similar parameter count
+    */
+
+    size_t totalParameters = 0;
+    for (Layer *layer : layers)
+    {
+        totalParameters += layer->getWeights()->data.size();
+    }
+
+    uint layer = 0;
+    size_t accumulated = 0;
+    for (uint s = 0; s < stageCount; s++)
+    {
+        Stage *stage = new Stage();
+        stage->index = s;
+        stage->firstLayer = layer;
+
+        size_t target = totalParameters * (s + 1) / stageCount;
+        uint remainingStages = stageCount - s - 1;
+        do
+        {
+            accumulated += layers[layer]->getWeights()->data.size();
+            layer++;
+        } while (layer < layers.size() - remainingStages && accumulated < target);
+
+        if (s == stageCount - 1)
+            layer = layers.size();
+        stage->endLayer = layer;
+        stages.push_back(stage);
+    }
+
+    /*
+        buffers
+    */
+
+    for (Stage *stage : stages)
+    {
+        for (uint l = stage->firstLayer; l < stage->endLayer; l++)
+        {
+            Matrix *weights = layers[l]->getWeights();
+            uint outputSize = weights->rows;
+            uint inputSize = weights->cols;
+
+            stage->weightedInputs.push_back(std::vector<Matrix>(microBatches, Matrix(outputSize, microBatchSize)));
+            stage->activations.push_back(std::vector<Matrix>(microBatches, Matrix(outputSize, microBatchSize)));
+
+            stage->gradients.push_back(Matrix(outputSize, microBatchSize));
+            stage->inputsT.push_back(Matrix(microBatchSize, inputSize));
+            stage->gradweightsPart.push_back(Matrix(outputSize, inputSize));
+            stage->gradbiasPart.push_back(Matrix(outputSize, 1));
+        }
+
+        stage->inputs.assign(microBatches, nullptr);
+        if (stage->index > 0)
+        {
+            Matrix *weights = layers[stage->firstLayer]->getWeights();
+            stage->weightsT = Matrix(weights->cols, weights->rows);
+            stage->dAout.assign(microBatches, Matrix(weights->cols, microBatchSize));
+        }
+    }
+
+    inputSlices.assign(microBatches, Matrix(layers.front()->getWeights()->cols, microBatchSize));
+    labelSlices.assign(microBatches, Matrix(1, microBatchSize));
+
+    /*
+        queues between neighbouring stages, a queue never holds more than all micro-batches
+    */
+
+    for (uint s = 0; s + 1 < stages.size(); s++)
+    {
+        SpscQueue<Message> *forward = new SpscQueue<Message>(microBatches);
+        SpscQueue<Message> *backward = new SpscQueue<Message>(microBatches);
+        queues.push_back(forward);
+        queues.push_back(backward);
+
+        stages[s]->forwardOut = forward;
+        stages[s + 1]->forwardIn = forward;
+        stages[s + 1]->backwardOut = backward;
+        stages[s]->backwardIn = backward;
+    }
+
+    for (Stage *stage : stages)
+    {
+        stage->thread = std::thread(&Pipeline::stageLoop, this, stage);
+    }
+}
+
+Pipeline::~Pipeline()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    condition.notify_all();
+
+    for (Stage *stage : stages)
+    {
+        stage->thread.join();
+        delete stage;
+    }
+    for (SpscQueue<Message> *queue : queues)
+    {
+        delete queue;
+    }
+}
+
+void Pipeline::forwardBackward(Matrix *data, Matrix *labels, float *loss)
+{
+    assert(data->cols == microBatches * microBatchSize && labels->rows == 1 && labels->cols == data->cols);
+
+    for (uint m = 0; m < microBatches; m++)
+    {
+        data->getCols(m * microBatchSize, (m + 1) * microBatchSize, &inputSlices[m]);
+        labels->getCols(m * microBatchSize, (m + 1) * microBatchSize, &labelSlices[m]);
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    finished = 0;
+    generation++;
+    condition.notify_all();
+    condition.wait(lock, [this]
+                   { return finished == stages.size(); });
+
+    *loss = stages.back()->loss;
+}
+
+void Pipeline::stageLoop(Stage *stage)
+{
+    uint seen = 0;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [this, seen]
+                           { return stop || generation != seen; });
+            if (stop)
+                return;
+            seen = generation;
+        }
+
+        {
+            AllocationScope scope("pipeline stage", stage->index);
+            runSchedule(stage);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            finished++;
+        }
+        condition.notify_all();
+    }
+}
+
+void Pipeline::runSchedule(Stage *stage)
+{
+    // the weights do not change during a pass, prepare the transpose once
+    if (stage->index > 0)
+    {
+        matrixTranspose(layers[stage->firstLayer]->getWeights(), &stage->weightsT);
+    }
+
+    for (uint l = stage->firstLayer; l < stage->endLayer; l++)
+    {
+        Matrix *gradweights = layers[l]->getGradWeights();
+        Matrix *gradbias = layers[l]->getGradBias();
+        assert(gradweights != nullptr && gradbias != nullptr); // Model::initTraining allocates them
+        std::fill(gradweights->data.begin(), gradweights->data.end(), 0.0f);
+        std::fill(gradbias->data.begin(), gradbias->data.end(), 0.0f);
+    }
+    stage->loss = 0.0f;
+
+    // 1F1B
+    uint warmup = std::min(static_cast<uint>(stages.size()) - stage->index - 1, microBatches);
+    uint nextForward = 0;
+    uint nextBackward = 0;
+
+    for (; nextForward < warmup; nextForward++)
+    {
+        forwardMicroBatch(stage, nextForward);
+    }
+
+    while (nextForward < microBatches)
+    {
+        forwardMicroBatch(stage, nextForward++);
+        backwardMicroBatch(stage, nextBackward++);
+    }
+
+    while (nextBackward < microBatches)
+    {
+        backwardMicroBatch(stage, nextBackward++);
+    }
+}
+
+void Pipeline::forwardMicroBatch(Stage *stage, uint m)
+{
+    Matrix *in;
+    if (stage->index == 0)
+    {
+        in = &inputSlices[m];
+    }
+    else
+    {
+        Message message = waitPop(stage->forwardIn);
+        assert(message.microBatch == m);
+        in = message.matrix;
+    }
+    stage->inputs[m] = in;
+
+    for (uint l = stage->firstLayer; l < stage->endLayer; l++)
+    {
+        uint local = l - stage->firstLayer;
+        if (l == layers.size() - 1)
+        {
+            // the last stage runs backward(m) right after forward(m), so dL/dz of the output layer can go
+            // straight into the shared gradient buffer
+            float loss;
+            layers[l]->forwardOutput(in, &labelSlices[m], &stage->weightedInputs[local][m], &stage->gradients[local], &stage->gradbiasPart[local], &loss);
+            stage->loss += loss / static_cast<float>(microBatches);
+        }
+        else
+        {
+            layers[l]->forward(in, &stage->weightedInputs[local][m], &stage->activations[local][m]);
+            in = &stage->activations[local][m];
+        }
+    }
+
+    if (stage->index < stages.size() - 1)
+    {
+        Message message;
+        message.microBatch = m;
+        message.matrix = in;
+        while (!stage->forwardOut->push(message))
+        {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void Pipeline::backwardMicroBatch(Stage *stage, uint m)
+{
+    Matrix *received = nullptr;
+    if (stage->index < stages.size() - 1)
+    {
+        Message message = waitPop(stage->backwardIn);
+        assert(message.microBatch == m);
+        received = message.matrix;
+    }
+
+    const float scale = 1.0f / static_cast<float>(microBatches);
+
+    for (uint l = stage->endLayer; l-- > stage->firstLayer;)
+    {
+        uint local = l - stage->firstLayer;
+        Layer *layer = layers[l];
+        Matrix *gradient = &stage->gradients[local];
+
+        // dL/dz and dL/db, the output layer has them from forwardOutput
+        bool outputLayer = l == layers.size() - 1;
+        if (!outputLayer && l == stage->endLayer - 1)
+        {
+            layer->hiddenGradient(received, &stage->weightedInputs[local][m], &stage->activations[local][m], gradient, &stage->gradbiasPart[local]);
+        }
+        else if (!outputLayer)
+        {
+            layer->hiddenGradient(layers[l + 1]->getWeights(), &stage->gradients[local + 1], &stage->weightedInputs[local][m], &stage->activations[local][m],
+                                  gradient, &stage->gradbiasPart[local]);
+        }
+
+        // accumulate the mean over all micro-batches
+        Matrix *in = (l == stage->firstLayer) ? stage->inputs[m] : &stage->activations[local - 1][m];
+        matrixTranspose(in, &stage->inputsT[local]);
+        matrixMultiply(gradient, &stage->inputsT[local], &stage->gradweightsPart[local]);
+
+        *layer->getGradWeights() += (scale / static_cast<float>(microBatchSize)) * stage->gradweightsPart[local];
+        *layer->getGradBias() += scale * stage->gradbiasPart[local];
+
+        // dL/da of the previous stage's last layer, inside a stage it is fused into hiddenGradient
+        if (l == stage->firstLayer && stage->index > 0)
+        {
+            matrixMultiply(&stage->weightsT, gradient, &stage->dAout[m]);
+
+            Message message;
+            message.microBatch = m;
+            message.matrix = &stage->dAout[m];
+            while (!stage->backwardOut->push(message))
+            {
+                std::this_thread::yield();
+            }
+        }
+    }
+}
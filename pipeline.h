@@ -0,0 +1,127 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "layer.h"
+#include "matrix.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+    bounded lock-free queue for exactly one producer and one consumer thread
+*/
+template <typename T>
+class SpscQueue
+{
+public:
+    explicit SpscQueue(size_t capacity_) : buffer(capacity_ + 1) {}
+
+    bool push(const T &value)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t next = (t + 1) % buffer.size();
+        if (next == head.load(std::memory_order_acquire))
+            return false; // full
+
+        buffer[t] = value;
+        tail.store(next, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T *value)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return false; // empty
+
+        *value = buffer[h];
+        head.store((h + 1) % buffer.size(), std::memory_order_release);
+        return true;
+    }
+
+private:
+    std::vector<T> buffer;
+    alignas(64) std::atomic<size_t> head{0}; // next slot to read
+    alignas(64) std::atomic<size_t> tail{0}; // next slot to write
+};
+
+/*
+    pipeline-parallel forward + backward pass
+
+    the layers are split into contiguous stages of roughly equal parameter count, every stage runs
+    on its own thread. a batch is split into micro-batches, activations travel forward and dL/da
+    travels backward between neighbouring stages through SpscQueues. every stage follows a 1F1B
+    schedule: (stages - stage - 1) warm-up forwards, then alternating forward / backward, then the
+    remaining backwards. the gradients of all micro-batches are accumulated into each layer's
+    gradweights / gradbias, so Layer::step works unchanged afterwards.
+*/
+class Pipeline
+{
+public:
+    Pipeline(const std::vector<Layer *> &layers_, uint stageCount, uint microBatches_, uint batchSize_);
+    ~Pipeline();
+
+    void forwardBackward(Matrix *data, Matrix *labels, float *loss);
+
+private:
+    struct Message
+    {
+        uint microBatch = 0;
+        Matrix *matrix = nullptr;
+    };
+
+    struct Stage
+    {
+        uint index = 0;
+        uint firstLayer = 0; // layers [firstLayer, endLayer)
+        uint endLayer = 0;
+
+        // [layer - firstLayer][microBatch]
+        std::vector<std::vector<Matrix>> weightedInputs;
+        std::vector<std::vector<Matrix>> activations;
+
+        // [layer - firstLayer], one micro-batch is in the backward pass at a time
+        std::vector<Matrix> gradients;
+        std::vector<Matrix> inputsT;
+        std::vector<Matrix> gradweightsPart;
+        std::vector<Matrix> gradbiasPart;
+
+        std::vector<Matrix *> inputs; // [microBatch] input of firstLayer
+        std::vector<Matrix> dAout;    // [microBatch] dL/da sent to the previous stage
+        Matrix weightsT;              // firstLayer weights^T, only if there is a previous stage
+
+        SpscQueue<Message> *forwardIn = nullptr;
+        SpscQueue<Message> *forwardOut = nullptr;
+        SpscQueue<Message> *backwardIn = nullptr;
+        SpscQueue<Message> *backwardOut = nullptr;
+
+        float loss = 0.0f;
+        std::thread thread;
+    };
+
+    std::vector<Layer *> layers;
+    std::vector<Stage *> stages;
+    std::vector<SpscQueue<Message> *> queues;
+    uint microBatches;
+    uint microBatchSize;
+
+    std::vector<Matrix> inputSlices;
+    std::vector<Matrix> labelSlices;
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    uint generation = 0;
+    uint finished = 0;
+    bool stop = false;
+
+    void stageLoop(Stage *stage);
+    void runSchedule(Stage *stage);
+    void forwardMicroBatch(Stage *stage, uint m);
+    void backwardMicroBatch(Stage *stage, uint m);
+};
+
+#endif
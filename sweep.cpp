@@ -0,0 +1,245 @@
+#include "sweep.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <iomanip>
+#include <random>
+
+namespace
+{
+    void copyRows(Matrix *from, uint fromRow, Matrix *to, uint toRow, uint rows, float scale = 1.0f)
+    {
+        assert(from->cols == to->cols);
+        const float *src = &from->data[static_cast<size_t>(fromRow) * from->cols];
+        float *dst = &to->data[static_cast<size_t>(toRow) * to->cols];
+        size_t count = static_cast<size_t>(rows) * to->cols;
+
+        if (scale == 1.0f)
+        {
+            std::copy(src, src + count, dst);
+        }
+        else
+        {
+            for (size_t i = 0; i < count; i++)
+                dst[i] = src[i] * scale;
+        }
+    }
+}
+
+Sweep::Sweep(uint inputSize_, uint numClasses_, uint batchSize_, uint threads) : inputSize(inputSize_),
+                                                                                 numClasses(numClasses_),
+                                                                                 batchSize(batchSize_),
+                                                                                 pool(threads),
+                                                                                 batch(inputSize_, batchSize_),
+                                                                                 batchT(batchSize_, inputSize_),
+                                                                                 batchLabels(1, batchSize_)
+{
+}
+
+Sweep::~Sweep()
+{
+    for (Model *model : models)
+    {
+        delete model;
+    }
+}
+
+uint Sweep::addModel(const SweepConfig &config)
+{
+    Model *model = new Model(config.seed);
+
+    uint previous = inputSize;
+    for (uint size : config.hiddenSizes)
+    {
+        model->addLayer(new Layer(previous, size, config.hiddenActivation));
+        previous = size;
+    }
+    model->addLayer(new Layer(previous, numClasses, ActivationType::SOFTMAX));
+
+    models.push_back(model);
+    configs.push_back(config);
+    return models.size() - 1;
+}
+
+void Sweep::initTraining()
+{
+    offsets.assign(1, 0);
+    products.clear();
+
+    for (Model *model : models)
+    {
+        model->initTraining(batchSize);
+
+        Layer *first = model->getLayer(0);
+        uint rows = first->getWeights()->rows;
+        offsets.push_back(offsets.back() + rows);
+        products.push_back(Matrix(rows, batchSize));
+    }
+
+    stackedWeights = Matrix(offsets.back(), inputSize);
+    stackedProduct = Matrix(offsets.back(), batchSize);
+    stackedGradient = Matrix(offsets.back(), batchSize);
+    stackedGradWeights = Matrix(offsets.back(), inputSize);
+
+    // products[] does not move any more, hand it to the first layers
+    for (uint m = 0; m < models.size(); m++)
+    {
+        Layer *first = models[m]->getLayer(0);
+        first->setInputProduct(&products[m]);
+        first->setExternalWeightGradient(true);
+    }
+}
+
+void Sweep::trainEpoch(Matrix *data, Matrix *labels, std::vector<float> *losses)
+{
+    assert(data->rows == inputSize && labels->rows == 1 && labels->cols == data->cols);
+    assert(offsets.size() == models.size() + 1); // initTraining
+
+    uint count = models.size();
+    uint numBatches = data->cols / batchSize;
+    losses->assign(count, 0.0f);
+    std::vector<float> batchLoss(count);
+
+    for (uint b = 0; b < numBatches; b++)
+    {
+        // the batch is assembled once for all models
+        data->getCols(b * batchSize, (b + 1) * batchSize, &batch);
+        labels->getCols(b * batchSize, (b + 1) * batchSize, &batchLabels);
+        matrixTranspose(&batch, &batchT);
+
+        pool.parallelFor(count, [&](uint m)
+                         { copyRows(models[m]->getLayer(0)->getWeights(), 0, &stackedWeights, offsets[m], offsets[m + 1] - offsets[m]); });
+
+        matrixMultiply(&stackedWeights, &batch, &stackedProduct);
+
+        pool.parallelFor(count, [&](uint m)
+                         {
+                             uint rows = offsets[m + 1] - offsets[m];
+                             copyRows(&stackedProduct, offsets[m], &products[m], 0, rows);
+
+                             models[m]->forward(&batch, &batchLabels, &batchLoss[m]);
+                             models[m]->calculateGradients(&batch);
+
+                             copyRows(models[m]->getLayer(0)->getGradient(), 0, &stackedGradient, offsets[m], rows); });
+
+        matrixMultiply(&stackedGradient, &batchT, &stackedGradWeights);
+
+        pool.parallelFor(count, [&](uint m)
+                         {
+                             Layer *first = models[m]->getLayer(0);
+                             copyRows(&stackedGradWeights, offsets[m], first->getGradWeights(), 0, offsets[m + 1] - offsets[m], 1.0f / static_cast<float>(batchSize));
+
+                             models[m]->step(configs[m].learningRate);
+                             (*losses)[m] += batchLoss[m] / static_cast<float>(numBatches); });
+    }
+}
+
+Model *Sweep::getModel(uint index)
+{
+    return models[index];
+}
+
+uint Sweep::getModelCount()
+{
+    return models.size();
+}
+
+bool sweepConformance(std::ostream &out)
+{
+    const uint inputSize = 100;
+    const uint numClasses = 10;
+    const uint batchSize = 32;
+    const uint samples = 8 * batchSize;
+    const int epochs = 2;
+    const float tolerance = 1e-5f;
+
+    std::vector<SweepConfig> configs(3);
+    configs[0].hiddenSizes = {64};
+    configs[0].seed = 1;
+    configs[1].hiddenSizes = {32, 16};
+    configs[1].hiddenActivation = ActivationType::RELU;
+    configs[1].learningRate = 0.05f;
+    configs[1].seed = 2;
+    configs[2].hiddenSizes = {48};
+    configs[2].learningRate = 0.2f;
+    configs[2].seed = 3;
+
+    std::mt19937 rng(5);
+    std::uniform_real_distribution<float> value(0.0f, 1.0f);
+    std::uniform_int_distribution<uint> label(0, numClasses - 1);
+    Matrix data(inputSize, samples), labels(1, samples);
+    for (float &x : data.data)
+    {
+        x = value(rng);
+    }
+    for (float &y : labels.data)
+    {
+        y = static_cast<float>(label(rng));
+    }
+
+    Sweep sweep(inputSize, numClasses, batchSize, 2);
+    for (const SweepConfig &config : configs)
+    {
+        sweep.addModel(config);
+    }
+    sweep.initTraining();
+    std::vector<std::vector<float>> sweepLosses(epochs);
+    for (int e = 0; e < epochs; e++)
+    {
+        sweep.trainEpoch(&data, &labels, &sweepLosses[e]);
+    }
+
+    bool ok = true;
+    Matrix batch(inputSize, batchSize), batchLabels(1, batchSize);
+    for (uint m = 0; m < configs.size(); m++)
+    {
+        // the same model as Sweep::addModel, trained alone
+        Model model(configs[m].seed);
+        uint previous = inputSize;
+        for (uint size : configs[m].hiddenSizes)
+        {
+            model.addLayer(new Layer(previous, size, configs[m].hiddenActivation));
+            previous = size;
+        }
+        model.addLayer(new Layer(previous, numClasses, ActivationType::SOFTMAX));
+        model.initTraining(batchSize);
+
+        float lossError = 0.0f;
+        for (int e = 0; e < epochs; e++)
+        {
+            float lossSum = 0.0f;
+            for (uint b = 0; b < samples / batchSize; b++)
+            {
+                float loss;
+                data.getCols(b * batchSize, (b + 1) * batchSize, &batch);
+                labels.getCols(b * batchSize, (b + 1) * batchSize, &batchLabels);
+                model.forwardBackward(&batch, &batchLabels, &loss);
+                model.step(configs[m].learningRate);
+                lossSum += loss / static_cast<float>(samples / batchSize);
+            }
+            lossError = std::max(lossError, std::fabs(lossSum - sweepLosses[e][m]) / std::max(std::fabs(lossSum), 1.0f));
+        }
+
+        float weightsError = 0.0f;
+        Model *swept = sweep.getModel(m);
+        for (int l = 0; l < model.getLayerCount(); l++)
+        {
+            Matrix *parameters[] = {model.getLayer(l)->getWeights(), model.getLayer(l)->getBias()};
+            Matrix *sweptParameters[] = {swept->getLayer(l)->getWeights(), swept->getLayer(l)->getBias()};
+            for (int p = 0; p < 2; p++)
+            {
+                for (size_t i = 0; i < parameters[p]->data.size(); i++)
+                {
+                    float expected = parameters[p]->data[i];
+                    weightsError = std::max(weightsError, std::fabs(expected - sweptParameters[p]->data[i]) / std::max(std::fabs(expected), 1.0f));
+                }
+            }
+        }
+
+        bool passed = lossError <= tolerance && weightsError <= tolerance;
+        out << "model " << m << std::setw(24) << "loss relative error" << std::setw(13) << lossError << std::setw(26) << "weights relative error"
+            << std::setw(13) << weightsError << (passed ? "  ok" : "  FAILED") << std::endl;
+        ok = ok && passed;
+    }
+    return ok;
+}
@@ -0,0 +1,67 @@
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include "layer.h"
+#include "matrix.h"
+#include "model.h"
+#include "threadpool.h"
+
+#include <ostream>
+#include <vector>
+
+struct SweepConfig
+{
+    std::vector<uint> hiddenSizes;
+    ActivationType hiddenActivation = ActivationType::SIGMOID;
+    float learningRate = 0.1f;
+    uint seed = 1;
+};
+
+/*
+    trains several model configurations in one process on one shared, read-only dataset.
+    every batch is extracted once and fed to all models, which train concurrently on a ThreadPool.
+    all first layers see the same input, so their products are stacked into one GEMM
+    [W_1; ...; W_n] * batch, and their weight gradients into [dL/dz_1; ...; dL/dz_n] * batch^T,
+    which also transposes the batch only once.
+*/
+class Sweep
+{
+public:
+    Sweep(uint inputSize_, uint numClasses_, uint batchSize_, uint threads = 0);
+    ~Sweep();
+
+    uint addModel(const SweepConfig &config);
+    void initTraining();
+    void trainEpoch(Matrix *data, Matrix *labels, std::vector<float> *losses); // labels: 1 x samples class indices
+
+    Model *getModel(uint index);
+    uint getModelCount();
+
+private:
+    uint inputSize;
+    uint numClasses;
+    uint batchSize;
+
+    std::vector<Model *> models;
+    std::vector<SweepConfig> configs;
+    ThreadPool pool;
+
+    // first layers of all models, model m owns rows [offsets[m], offsets[m + 1])
+    std::vector<uint> offsets;
+    Matrix stackedWeights;
+    Matrix stackedProduct;
+    Matrix stackedGradient;
+    Matrix stackedGradWeights;
+    std::vector<Matrix> products;
+
+    Matrix batch;
+    Matrix batchT;
+    Matrix batchLabels;
+};
+
+// a few configurations trained through Sweep against the same configurations trained one by one as
+// Models with the same seeds: the loss per epoch and the final weights have to match up to the rounding
+// of the stacked gemm. prints one line per check, false on a mismatch (benchmark --sweep-conformance)
+bool sweepConformance(std::ostream &out);
+
+#endif
@@ -0,0 +1,97 @@
+#include "threadpool.h"
+#include <algorithm>
+
+ThreadPool::ThreadPool(uint threads)
+{
+    if (threads == 0)
+    {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // the caller of parallelFor is one of the threads
+    for (uint t = 1; t < threads; t++)
+    {
+        workers.emplace_back(&ThreadPool::workerLoop, this);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    condition.notify_all();
+
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
+}
+
+uint ThreadPool::size()
+{
+    return workers.size() + 1;
+}
+
+void ThreadPool::parallelFor(uint count_, const std::function<void(uint)> &task_)
+{
+    if (count_ == 0)
+        return;
+
+    if (workers.empty() || count_ == 1)
+    {
+        for (uint i = 0; i < count_; i++)
+            task_(i);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        task = &task_;
+        count = count_;
+        next.store(0);
+        busyWorkers = workers.size();
+        generation++;
+    }
+    condition.notify_all();
+
+    runTasks();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this]
+              { return busyWorkers == 0; });
+    task = nullptr;
+}
+
+void ThreadPool::workerLoop()
+{
+    uint seen = 0;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [this, seen]
+                           { return stop || generation != seen; });
+            if (stop)
+                return;
+            seen = generation;
+        }
+
+        runTasks();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            busyWorkers--;
+        }
+        done.notify_one();
+    }
+}
+
+void ThreadPool::runTasks()
+{
+    for (uint i = next.fetch_add(1); i < count; i = next.fetch_add(1))
+    {
+        (*task)(i);
+    }
+}
@@ -0,0 +1,44 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+typedef uint32_t uint;
+
+/*
+    fixed set of worker threads running index ranges. parallelFor blocks until every index is
+    done, the calling thread works along. tasks must not call parallelFor on the same pool.
+*/
+class ThreadPool
+{
+public:
+    explicit ThreadPool(uint threads = 0); // 0 = one per hardware thread
+    ~ThreadPool();
+
+    uint size();
+    void parallelFor(uint count, const std::function<void(uint)> &task_);
+
+private:
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::condition_variable done;
+
+    const std::function<void(uint)> *task = nullptr;
+    uint count = 0;
+    std::atomic<uint> next{0};
+    uint busyWorkers = 0;
+    uint generation = 0;
+    bool stop = false;
+
+    void workerLoop();
+    void runTasks();
+};
+
+#endif
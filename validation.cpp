@@ -0,0 +1,173 @@
+#include "validation.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <utility>
+
+AsyncValidator::AsyncValidator(Matrix *data_, Matrix *labels_, uint chunkSize_, std::function<void(const ValidationResult &)> callback_) : data(data_),
+                                                                                                                                          labels(labels_),
+                                                                                                                                          chunkSize(std::max(1u, std::min(chunkSize_, data_->cols))),
+                                                                                                                                          callback(std::move(callback_))
+{
+    assert(labels->rows == 1 && labels->cols == data->cols);
+    worker = std::thread(&AsyncValidator::workerLoop, this);
+}
+
+AsyncValidator::~AsyncValidator()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    condition.notify_all();
+    worker.join();
+}
+
+bool AsyncValidator::submit(Model *model, int epoch, int batch)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (busy)
+            return false;
+        busy = true;
+    }
+
+    // the worker only touches pending after it was signalled
+    model->snapshot(&pending);
+    pendingResult.epoch = epoch;
+    pendingResult.batch = batch;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::swap(pending.layers, evaluating.layers);
+    }
+    condition.notify_all();
+    return true;
+}
+
+void AsyncValidator::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    condition.wait(lock, [this]
+                   { return !busy; });
+}
+
+void AsyncValidator::setEarlyStopping(uint patience_, float minDelta_)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    patience = patience_;
+    minDelta = minDelta_;
+}
+
+bool AsyncValidator::shouldStop()
+{
+    return stopRequested.load(std::memory_order_relaxed);
+}
+
+ValidationResult AsyncValidator::getBest()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return bestResult;
+}
+
+void AsyncValidator::restoreBest(Model *model)
+{
+    wait();
+    std::lock_guard<std::mutex> lock(mutex);
+    if (hasBest)
+    {
+        model->restore(best);
+    }
+}
+
+void AsyncValidator::workerLoop()
+{
+    while (true)
+    {
+        ValidationResult result;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [this]
+                           { return stop || (busy && !evaluating.layers.empty()); });
+            if (stop)
+                return;
+            result = pendingResult;
+        }
+
+        ValidationResult measured;
+        {
+            AllocationScope scope("validation");
+            measured = evaluate(&evaluating);
+        }
+        result.accuracy = measured.accuracy;
+        result.loss = measured.loss;
+
+        if (callback)
+        {
+            callback(result);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!hasBest || result.accuracy > bestResult.accuracy + minDelta)
+            {
+                hasBest = true;
+                bestResult = result;
+                best.layers = evaluating.layers;
+                sinceImprovement = 0;
+            }
+            else if (patience > 0 && ++sinceImprovement >= patience)
+            {
+                stopRequested.store(true, std::memory_order_relaxed);
+            }
+
+            // hand the buffers back for the next submit
+            std::swap(pending.layers, evaluating.layers);
+            evaluating.layers.clear();
+            busy = false;
+        }
+        condition.notify_all();
+    }
+}
+
+ValidationResult AsyncValidator::evaluate(ModelSnapshot *snapshot)
+{
+    uint classes = snapshot->layers.back().weights.rows;
+    Matrix chunk(data->rows, chunkSize);
+    Matrix prediction(classes, chunkSize);
+
+    float correct = 0.0f;
+    float loss = 0.0f;
+    uint evaluated = 0;
+
+    for (uint start = 0; start < data->cols; start += chunkSize)
+    {
+        uint end = std::min(start + chunkSize, data->cols);
+        if (end - start != chunk.cols)
+        {
+            chunk = Matrix(data->rows, end - start);
+        }
+        data->getCols(start, end, &chunk);
+        snapshot->predict(&chunk, &prediction);
+
+        for (uint j = 0; j < chunk.cols; j++)
+        {
+            uint label = static_cast<uint>(labels->data[start + j]);
+            uint argmax = 0;
+            for (uint i = 1; i < classes; i++)
+            {
+                if (prediction.data[i * prediction.cols + j] > prediction.data[argmax * prediction.cols + j])
+                    argmax = i;
+            }
+
+            correct += argmax == label ? 1.0f : 0.0f;
+            loss -= std::log(std::max(prediction.data[label * prediction.cols + j], 1e-12f));
+        }
+        evaluated += chunk.cols;
+    }
+
+    ValidationResult result;
+    result.accuracy = correct / static_cast<float>(evaluated);
+    result.loss = loss / static_cast<float>(evaluated);
+    return result;
+}
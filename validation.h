@@ -0,0 +1,74 @@
+#ifndef VALIDATION_H
+#define VALIDATION_H
+
+#include "matrix.h"
+#include "model.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+struct ValidationResult
+{
+    int epoch = 0;
+    int batch = 0;
+    float accuracy = 0.0f;
+    float loss = 0.0f;
+};
+
+/*
+    evaluates snapshots of a model's parameters on a validation set in a background thread.
+
+    submit() only copies the parameters into a reused snapshot (no allocation after the first call)
+    and returns; while an evaluation is running further submits are dropped, so the training thread
+    never waits. the data is evaluated in chunks of chunkSize columns to bound the buffers.
+    the callback runs on the background thread.
+
+    with setEarlyStopping(patience), shouldStop() turns true once the accuracy has not improved
+    for patience evaluations, restoreBest() loads the best parameters seen so far into a model.
+*/
+class AsyncValidator
+{
+public:
+    AsyncValidator(Matrix *data_, Matrix *labels_, uint chunkSize_, std::function<void(const ValidationResult &)> callback_);
+    ~AsyncValidator();
+
+    bool submit(Model *model, int epoch, int batch);
+    void wait();
+
+    void setEarlyStopping(uint patience_, float minDelta_ = 0.0f);
+    bool shouldStop();
+    ValidationResult getBest();
+    void restoreBest(Model *model);
+
+private:
+    Matrix *data;   // features x samples
+    Matrix *labels; // 1 x samples, class indices
+    uint chunkSize;
+    std::function<void(const ValidationResult &)> callback;
+
+    ModelSnapshot pending;
+    ModelSnapshot evaluating;
+    ModelSnapshot best;
+    ValidationResult pendingResult;
+    ValidationResult bestResult;
+    bool hasBest = false;
+
+    uint patience = 0;
+    float minDelta = 0.0f;
+    uint sinceImprovement = 0;
+    std::atomic<bool> stopRequested{false};
+
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool busy = false;
+    bool stop = false;
+
+    void workerLoop();
+    ValidationResult evaluate(ModelSnapshot *snapshot);
+};
+
+#endif